@@ -18,10 +18,13 @@
 #include <FS.h>
 #include <SD.h>
 
-// perform the actual update from a given stream
-void performUpdate(Stream &updateSource, size_t updateSize) {
+// perform the actual update from a given file
+void performUpdate(File &updateSource, size_t updateSize) {
+   // read 16KB at a time and program the flash while the next block is read
+   Update.setBufferSize(16 * 1024);
+   Update.setPipeline(2);
    if (Update.begin(updateSize)) {      
-      size_t written = Update.writeStream(updateSource);
+      size_t written = Update.writeFile(updateSource);
       if (written == updateSize) {
          Serial.println("Written : " + String(written) + " successfully");
       }
@@ -0,0 +1,111 @@
+#include "ChunkManifest.h"
+
+static uint32_t _le32(const uint8_t *p){
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+ChunkManifest::ChunkManifest()
+: _running(false)
+, _signed(false)
+, _digests(NULL)
+, _chunkSize(0)
+, _imageSize(0)
+, _chunk(0)
+, _chunkLen(0)
+, _offset(0)
+{
+    mbedtls_sha256_init(&_sha256);
+}
+
+ChunkManifest::~ChunkManifest(){
+    end();
+}
+
+bool ChunkManifest::isManifest(const uint8_t *data, size_t len){
+    return len >= 4 && !memcmp(data, CHUNK_MANIFEST_MAGIC, 4);
+}
+
+bool ChunkManifest::begin(const uint8_t *data, size_t len, mbedtls_pk_context *key){
+    end();
+    if(len != CHUNK_MANIFEST_SIZE || !isManifest(data, len)){
+        return false;
+    }
+    uint32_t chunkSize = _le32(data + 4);
+    uint32_t imageSize = _le32(data + 8);
+    size_t sigLen = data[12] | (data[13] << 8);
+    if(!chunkSize || !imageSize){
+        return false;
+    }
+    uint32_t chunks = imageSize / chunkSize + (imageSize % chunkSize != 0);
+    if(chunks > (CHUNK_MANIFEST_SIZE - CHUNK_MANIFEST_HEADER_SIZE) / 32){
+        return false;
+    }
+    size_t signedLen = CHUNK_MANIFEST_HEADER_SIZE + chunks * 32;
+    if(signedLen + sigLen > CHUNK_MANIFEST_SIZE){
+        return false;
+    }
+    if(key){
+        uint8_t hash[32];
+        if(!sigLen || mbedtls_sha256_ret(data, signedLen, hash, 0)
+        || mbedtls_pk_verify(key, MBEDTLS_MD_SHA256, hash, sizeof(hash), data + signedLen, sigLen)){
+            return false;
+        }
+    }
+    _digests = (uint8_t*)malloc(chunks * 32);
+    if(!_digests){
+        return false;
+    }
+    memcpy(_digests, data + CHUNK_MANIFEST_HEADER_SIZE, chunks * 32);
+    _chunkSize = chunkSize;
+    _imageSize = imageSize;
+    _chunk = _chunkLen = _offset = 0;
+    _signed = key != NULL;
+    if(mbedtls_sha256_starts_ret(&_sha256, 0)){
+        end();
+        return false;
+    }
+    _running = true;
+    return true;
+}
+
+bool ChunkManifest::add(const uint8_t *data, size_t len){
+    if(!_running || len > _imageSize - _offset){
+        return false;
+    }
+    while(len){
+        size_t part = _chunkSize - _chunkLen;
+        if(part > len){
+            part = len;
+        }
+        if(mbedtls_sha256_update_ret(&_sha256, data, part)){
+            return false;
+        }
+        _chunkLen += part;
+        _offset += part;
+        data += part;
+        len -= part;
+        if(_chunkLen == _chunkSize || _offset == _imageSize){
+            uint8_t hash[32];
+            if(mbedtls_sha256_finish_ret(&_sha256, hash)
+            || memcmp(hash, _digests + _chunk * 32, sizeof(hash))){
+                return false;
+            }
+            _chunk++;
+            _chunkLen = 0;
+            if(mbedtls_sha256_starts_ret(&_sha256, 0)){
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void ChunkManifest::end(){
+    free(_digests);
+    _digests = NULL;
+    _running = false;
+    _signed = false;
+    //also releases the SHA engine on chips that lock it per context
+    mbedtls_sha256_free(&_sha256);
+    mbedtls_sha256_init(&_sha256);
+}
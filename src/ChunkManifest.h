@@ -0,0 +1,68 @@
+#ifndef CHUNKMANIFEST_H
+#define CHUNKMANIFEST_H
+
+#include <Arduino.h>
+#include "mbedtls/pk.h"
+#include "mbedtls/sha256.h"
+
+#define CHUNK_MANIFEST_MAGIC       "UCM\x01"
+#define CHUNK_MANIFEST_SIZE        4096
+#define CHUNK_MANIFEST_HEADER_SIZE 16
+
+/*
+  Per-chunk SHA-256 digests of an image, sent in front of it
+  The manifest is one CHUNK_MANIFEST_SIZE block, padded with any bytes:
+    "UCM\x01", chunk size (uint32 little endian), image size (uint32),
+    signature length (uint16), 2 reserved bytes,
+    one 32 byte digest per chunk of the image (the last chunk may be shorter),
+    signature of the SHA-256 of the header and digests
+  The digests are over the image as it is written to the flash,
+  i.e. after decompression or patching
+*/
+class ChunkManifest {
+  public:
+    ChunkManifest();
+    ~ChunkManifest();
+
+    /*
+      Returns true if data starts with the manifest magic
+    */
+    static bool isManifest(const uint8_t *data, size_t len);
+
+    /*
+      Parses the manifest block and checks its signature with key
+      key may be NULL, the signature is then not checked
+      Returns false if the block is malformed, the signature does not match or memory runs out
+    */
+    bool begin(const uint8_t *data, size_t len, mbedtls_pk_context *key);
+
+    /*
+      Hashes the next len bytes of the image, checking each chunk as soon as it is complete
+      Returns false on the first chunk that does not match or once the image gets
+      larger than the manifest says
+    */
+    bool add(const uint8_t *data, size_t len);
+
+    /*
+      Releases the digests, safe to call at any time
+    */
+    void end();
+
+    bool isRunning(){ return _running; }
+    bool isFinished(){ return _running && _offset == _imageSize; }
+    bool isSigned(){ return _signed; }
+    uint32_t chunk(){ return _chunk; }
+
+  private:
+    bool _running;
+    bool _signed;
+    uint8_t *_digests;
+    uint32_t _chunkSize;
+    uint32_t _imageSize;
+    uint32_t _chunk;        // index of the chunk being hashed
+    uint32_t _chunkLen;     // bytes of it hashed so far
+    uint32_t _offset;       // bytes of the image hashed so far
+    mbedtls_sha256_context _sha256;
+};
+
+#endif
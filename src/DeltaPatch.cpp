@@ -0,0 +1,149 @@
+#include "DeltaPatch.h"
+
+static int64_t _offtin(const uint8_t *buf){
+    //bsdiff stores signed 64 bit numbers as magnitude plus sign bit
+    int64_t y = buf[7] & 0x7F;
+    for(int i = 6; i >= 0; i--){
+        y = (y << 8) | buf[i];
+    }
+    return (buf[7] & 0x80) ? -y : y;
+}
+
+DeltaPatch::DeltaPatch()
+: _source(NULL)
+, _output(NULL)
+, _chunk(NULL)
+, _recordLen(0)
+, _state(DELTA_HEADER)
+, _newSize(0)
+, _newPos(0)
+, _oldPos(0)
+, _diffLeft(0)
+, _extraLeft(0)
+, _seek(0)
+{
+}
+
+bool DeltaPatch::begin(const esp_partition_t *source, THandlerFunction_Output output){
+    end();
+    if(!source){
+        log_e("no source partition");
+        return false;
+    }
+    _chunk = (uint8_t*)malloc(DELTA_PATCH_CHUNK_SIZE);
+    if(!_chunk){
+        log_e("malloc failed");
+        return false;
+    }
+    _source = source;
+    _output = output;
+    _recordLen = 0;
+    _state = DELTA_HEADER;
+    _newSize = _newPos = _oldPos = 0;
+    _diffLeft = _extraLeft = _seek = 0;
+    return true;
+}
+
+void DeltaPatch::end(){
+    free(_chunk);
+    _chunk = NULL;
+    _output = NULL;
+}
+
+void DeltaPatch::_settle(){
+    //move past records that need no more input
+    if(_state == DELTA_DIFF && !_diffLeft){
+        _state = DELTA_EXTRA;
+    }
+    if(_state == DELTA_EXTRA && !_extraLeft){
+        _oldPos += _seek;
+        _state = (_newPos == _newSize) ? DELTA_DONE : DELTA_CONTROL;
+    }
+}
+
+bool DeltaPatch::write(const uint8_t *data, size_t len){
+    if(!_chunk){
+        return false;
+    }
+    while(len){
+        size_t n;
+        switch(_state){
+        case DELTA_HEADER:
+        case DELTA_CONTROL:
+            n = sizeof(_record) - _recordLen;
+            if(n > len){
+                n = len;
+            }
+            memcpy(_record + _recordLen, data, n);
+            _recordLen += n;
+            if(_recordLen < sizeof(_record)){
+                break;
+            }
+            _recordLen = 0;
+            if(_state == DELTA_HEADER){
+                _newSize = _offtin(_record + 16);
+                if(memcmp(_record, DELTA_PATCH_MAGIC, 16) || _newSize < 0){
+                    log_e("bad patch header");
+                    return false;
+                }
+                _state = _newSize ? DELTA_CONTROL : DELTA_DONE;
+                break;
+            }
+            _diffLeft = _offtin(_record);
+            _extraLeft = _offtin(_record + 8);
+            _seek = _offtin(_record + 16);
+            if(_diffLeft < 0 || _extraLeft < 0 || _newPos + _diffLeft + _extraLeft > _newSize){
+                log_e("bad patch control");
+                return false;
+            }
+            _state = DELTA_DIFF;
+            break;
+
+        case DELTA_DIFF:
+            n = DELTA_PATCH_CHUNK_SIZE;
+            if(n > len){
+                n = len;
+            }
+            if((int64_t)n > _diffLeft){
+                n = _diffLeft;
+            }
+            if(_oldPos < 0 || _oldPos + (int64_t)n > _source->size){
+                log_e("patch reads outside source");
+                return false;
+            }
+            if(!ESP.partitionRead(_source, _oldPos, (uint32_t*)_chunk, n)){
+                return false;
+            }
+            for(size_t i = 0; i < n; i++){
+                _chunk[i] += data[i];
+            }
+            if(!_output(_chunk, n)){
+                return false;
+            }
+            _oldPos += n;
+            _newPos += n;
+            _diffLeft -= n;
+            break;
+
+        case DELTA_EXTRA:
+            n = len;
+            if((int64_t)n > _extraLeft){
+                n = _extraLeft;
+            }
+            if(!_output(data, n)){
+                return false;
+            }
+            _newPos += n;
+            _extraLeft -= n;
+            break;
+
+        default:
+            log_e("data after end of patch");
+            return false;
+        }
+        data += n;
+        len -= n;
+        _settle();
+    }
+    return true;
+}
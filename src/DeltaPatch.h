@@ -0,0 +1,70 @@
+#ifndef DELTAPATCH_H
+#define DELTAPATCH_H
+
+#include <Arduino.h>
+#include <functional>
+#include "esp_partition.h"
+
+#define DELTA_PATCH_MAGIC      "ENDSLEY/BSDIFF43"
+#define DELTA_PATCH_CHUNK_SIZE 512
+
+/*
+  Streaming applier for bsdiff patches against a source partition
+  The patch is the ENDSLEY/BSDIFF43 header and new size, followed by the
+  control/diff/extra records as plain data (not bzip2 compressed)
+  Rebuilt bytes are passed in order to the output handler
+*/
+class DeltaPatch {
+  public:
+    typedef std::function<bool(const uint8_t*, size_t)> THandlerFunction_Output;
+
+    DeltaPatch();
+
+    /*
+      Prepares for a new patch read against source
+      Returns false if there is no source or no memory
+    */
+    bool begin(const esp_partition_t *source, THandlerFunction_Output output);
+
+    /*
+      Consumes the next piece of the patch
+      Returns false if the patch is malformed, reads outside the source,
+      the source can not be read or the output handler fails
+    */
+    bool write(const uint8_t *data, size_t len);
+
+    /*
+      Releases the buffers, safe to call at any time
+    */
+    void end();
+
+    bool isRunning(){ return _chunk != NULL; }
+    bool isFinished(){ return _state == DELTA_DONE; }
+    size_t newSize(){ return _newSize; }
+
+  private:
+    typedef enum {
+        DELTA_HEADER,
+        DELTA_CONTROL,
+        DELTA_DIFF,
+        DELTA_EXTRA,
+        DELTA_DONE
+    } DeltaState_t;
+
+    void _settle();
+
+    const esp_partition_t *_source;
+    THandlerFunction_Output _output;
+    uint8_t *_chunk;
+    uint8_t _record[24];
+    size_t _recordLen;
+    DeltaState_t _state;
+    int64_t _newSize;
+    int64_t _newPos;
+    int64_t _oldPos;
+    int64_t _diffLeft;
+    int64_t _extraLeft;
+    int64_t _seek;
+};
+
+#endif
@@ -0,0 +1,156 @@
+#include "HeatshrinkDecoder.h"
+
+HeatshrinkDecoder::HeatshrinkDecoder()
+: _output(NULL)
+, _running(false)
+, _state(HS_HEADER)
+, _headerLen(0)
+, _window(NULL)
+, _windowBits(0)
+, _lookaheadBits(0)
+, _head(0)
+, _flushed(0)
+, _size(0)
+, _index(0)
+, _bits(0)
+, _bitCount(0)
+{
+}
+
+bool HeatshrinkDecoder::isCompressed(const uint8_t *data, size_t len){
+    return len >= 4 && !memcmp(data, HEATSHRINK_MAGIC, 4);
+}
+
+bool HeatshrinkDecoder::begin(THandlerFunction_Output output){
+    end();
+    _output = output;
+    _state = HS_HEADER;
+    _headerLen = 0;
+    _head = _flushed = 0;
+    _bits = 0;
+    _bitCount = 0;
+    _running = true;
+    return true;
+}
+
+void HeatshrinkDecoder::end(){
+    free(_window);
+    _window = NULL;
+    _output = NULL;
+    _running = false;
+}
+
+bool HeatshrinkDecoder::_parseHeader(){
+    if(!isCompressed(_header, sizeof(_header))){
+        log_e("bad compression magic");
+        return false;
+    }
+    _windowBits = _header[4];
+    _lookaheadBits = _header[5];
+    _size = _header[8] | (_header[9] << 8) | (_header[10] << 16) | ((uint32_t)_header[11] << 24);
+    if(_windowBits < 4 || _windowBits > HEATSHRINK_MAX_WINDOW_BITS || _lookaheadBits < 3 || _lookaheadBits >= _windowBits){
+        log_e("unsupported window %u/%u", _windowBits, _lookaheadBits);
+        return false;
+    }
+    _window = (uint8_t*)calloc(1, 1 << _windowBits);
+    if(!_window){
+        log_e("malloc failed");
+        return false;
+    }
+    _state = _size ? HS_TAG : HS_DONE;
+    return true;
+}
+
+bool HeatshrinkDecoder::_flush(){
+    //pending bytes are the tail of the window, at most two contiguous runs
+    const uint32_t mask = (1 << _windowBits) - 1;
+    while(_flushed != _head){
+        uint32_t start = _flushed & mask;
+        uint32_t len = _head - _flushed;
+        if(start + len > mask + 1){
+            len = mask + 1 - start;
+        }
+        if(!_output(_window + start, len)){
+            return false;
+        }
+        _flushed += len;
+    }
+    return true;
+}
+
+bool HeatshrinkDecoder::_put(uint8_t c){
+    if(_head == _size){
+        log_e("more data than declared");
+        return false;
+    }
+    _window[_head & ((1 << _windowBits) - 1)] = c;
+    _head++;
+    //flush before the oldest pending byte would be overwritten
+    if(_head - _flushed == (1u << _windowBits) || _head == _size){
+        if(!_flush()){
+            return false;
+        }
+    }
+    if(_head == _size){
+        _state = HS_DONE;
+    }
+    return true;
+}
+
+bool HeatshrinkDecoder::write(const uint8_t *data, size_t len){
+    if(!_running){
+        return false;
+    }
+    while(len && _state == HS_HEADER){
+        _header[_headerLen++] = *data++;
+        len--;
+        if(_headerLen == sizeof(_header) && !_parseHeader()){
+            return false;
+        }
+    }
+    for(; len; data++, len--){
+        if(_state == HS_DONE){
+            log_e("data after end of stream");
+            return false;
+        }
+        _bits = (_bits << 8) | *data;
+        _bitCount += 8;
+        //consume every complete field, the last byte may end in padding
+        for(;;){
+            uint8_t need = 1;
+            if(_state == HS_LITERAL){
+                need = 8;
+            } else if(_state == HS_INDEX){
+                need = _windowBits;
+            } else if(_state == HS_COUNT){
+                need = _lookaheadBits;
+            }
+            if(_state == HS_DONE || _bitCount < need){
+                break;
+            }
+            _bitCount -= need;
+            uint32_t value = (_bits >> _bitCount) & ((1 << need) - 1);
+            if(_state == HS_TAG){
+                _state = value ? HS_LITERAL : HS_INDEX;
+            } else if(_state == HS_LITERAL){
+                _state = HS_TAG;
+                if(!_put(value)){
+                    return false;
+                }
+            } else if(_state == HS_INDEX){
+                _index = value + 1;
+                _state = HS_COUNT;
+            } else {
+                //references before the start read the zeroed window, like the encoder
+                _state = HS_TAG;
+                for(uint32_t i = 0; i <= value; i++){
+                    if(!_put(_window[(_head - _index) & ((1 << _windowBits) - 1)])){
+                        return false;
+                    }
+                }
+            }
+        }
+        _bits &= (1 << _bitCount) - 1;
+    }
+    return true;
+}
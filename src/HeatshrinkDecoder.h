@@ -0,0 +1,79 @@
+#ifndef HEATSHRINKDECODER_H
+#define HEATSHRINKDECODER_H
+
+#include <Arduino.h>
+#include <functional>
+
+#define HEATSHRINK_MAGIC           "HSZ\x01"
+#define HEATSHRINK_HEADER_SIZE     12
+#define HEATSHRINK_MAX_WINDOW_BITS 12
+
+/*
+  Streaming decoder for heatshrink (LZSS) compressed images
+  The stream starts with a 12 byte header:
+    "HSZ\x01", window bits, lookahead bits, 2 reserved bytes,
+    decompressed size (uint32 little endian)
+  followed by the output of `heatshrink -e -w <window> -l <lookahead>`
+  Memory use is one window of 2^window bytes (at most 2^HEATSHRINK_MAX_WINDOW_BITS)
+  Decoded bytes are passed in order to the output handler
+*/
+class HeatshrinkDecoder {
+  public:
+    typedef std::function<bool(const uint8_t*, size_t)> THandlerFunction_Output;
+
+    HeatshrinkDecoder();
+
+    /*
+      Returns true if data starts with the compressed stream magic
+    */
+    static bool isCompressed(const uint8_t *data, size_t len);
+
+    bool begin(THandlerFunction_Output output);
+
+    /*
+      Consumes the next piece of the compressed stream
+      Returns false if the header is invalid, the stream decodes to more
+      than the declared size, memory runs out or the output handler fails
+    */
+    bool write(const uint8_t *data, size_t len);
+
+    /*
+      Releases the window, safe to call at any time
+    */
+    void end();
+
+    bool isRunning(){ return _running; }
+    bool isFinished(){ return _state == HS_DONE; }
+    size_t size(){ return _size; }
+
+  private:
+    typedef enum {
+        HS_HEADER,
+        HS_TAG,
+        HS_LITERAL,
+        HS_INDEX,
+        HS_COUNT,
+        HS_DONE
+    } HeatshrinkState_t;
+
+    bool _parseHeader();
+    bool _put(uint8_t c);
+    bool _flush();
+
+    THandlerFunction_Output _output;
+    bool _running;
+    HeatshrinkState_t _state;
+    uint8_t _header[HEATSHRINK_HEADER_SIZE];
+    size_t _headerLen;
+    uint8_t *_window;
+    uint8_t _windowBits;
+    uint8_t _lookaheadBits;
+    uint32_t _head;      // bytes decoded so far
+    uint32_t _flushed;   // bytes passed to the output so far
+    uint32_t _size;
+    uint32_t _index;
+    uint32_t _bits;
+    uint8_t _bitCount;
+};
+
+#endif
@@ -12,20 +12,63 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <freertos/event_groups.h>
+#include <freertos/semphr.h>
 
 #include "esp32-hal-log.h"
 #include "esp_http_client.h"
-#include "esp_https_ota.h"
+#include "esp_timer.h"
+#include "esp_spi_flash.h"
 
 #include "HttpsOTAUpdate.h"
-#define OTA_TASK_STACK_SIZE 9216
+#include "Update.h"
 
 typedef void (*HttpEventCb)(HttpEvent_t*);
+typedef void (*HttpsOTAProgressCb)(size_t, size_t);
 
 static esp_http_client_config_t config; 
 static HttpEventCb cb;
+static HttpsOTAProgressCb progress_cb;
 static EventGroupHandle_t ota_status = NULL;//check for ota status
 static EventBits_t set_bit;
+static char target_md5[33];
+static TaskHandle_t static_task = NULL;
+static StaticTask_t static_task_tcb;
+
+// what each OTA task is started with, constant so a task still finishing
+// never sees the settings of the next begin()
+typedef struct {
+    const esp_http_client_config_t *config;
+    bool is_static;     // suspends itself at the end, to be deleted by the next begin()
+} HttpsOTATaskParam_t;
+
+static const HttpsOTATaskParam_t dynamic_task_param = { &config, false };
+static const HttpsOTATaskParam_t static_task_param = { &config, true };
+
+// client kept open between requests with setKeepAlive()
+static bool keep_alive;
+static esp_http_client_handle_t kept_client = NULL;
+static esp_http_client_config_t kept_config;
+
+// connections fetching ranges in parallel with setParallelRanges()
+typedef struct {
+    uint8_t index;
+    bool ok;
+} HttpsOTARange_t;
+
+static uint8_t parallel_ranges = 1;
+static uint32_t stripe_size;
+static uint32_t next_stripe;
+static uint32_t stripe_reading[HTTPS_OTA_MAX_RANGES];  // by connection, UINT32_MAX once it stopped
+static SemaphoreHandle_t stripe_lock = NULL;
+static HttpsOTATaskConfig_t range_task;
+static EventGroupHandle_t ranges_done = NULL;
+static volatile bool ranges_failed;
+static volatile bool accept_ranges;
+
+static volatile size_t bytes_received;
+static volatile size_t image_size;
+static volatile uint32_t start_ms;
+static volatile uint32_t last_ms;
 
 const int OTA_IDLE_BIT = BIT0;
 const int OTA_UPDATING_BIT = BIT1;
@@ -34,18 +77,335 @@ const int OTA_FAIL_BIT = BIT3;
 
 esp_err_t http_event_handler(esp_http_client_event_t *event)
 {
-    cb(event); 
+    if(event->event_id == HTTP_EVENT_ON_HEADER && !strcasecmp(event->header_key, "Accept-Ranges")) {
+        accept_ranges = !strcasecmp(event->header_value, "bytes");
+    }
+    if(cb) {
+        cb(event);
+    }
     return ESP_OK;
 }
 
+static esp_http_client_handle_t https_ota_client(const esp_http_client_config_t *cfg)
+{
+    if(kept_client) {
+        // a different host makes esp_http_client_set_url() drop the connection by itself
+        if(kept_config.cert_pem == cfg->cert_pem
+        && kept_config.skip_cert_common_name_check == cfg->skip_cert_common_name_check
+        && kept_config.buffer_size == cfg->buffer_size
+        && esp_http_client_set_url(kept_client, cfg->url) == ESP_OK) {
+            // the request owns it until https_ota_release()
+            esp_http_client_handle_t client = kept_client;
+            kept_client = NULL;
+            return client;
+        }
+        esp_http_client_close(kept_client);
+        esp_http_client_cleanup(kept_client);
+        kept_client = NULL;
+    }
+    esp_http_client_handle_t client = esp_http_client_init(cfg);
+    if(!client) {
+        log_e("HTTP Client Init Failed");
+    }
+    return client;
+}
+
+static void https_ota_release(esp_http_client_handle_t client, bool reusable)
+{
+    if(!keep_alive) {
+        esp_http_client_close(client);
+        esp_http_client_cleanup(client);
+        return;
+    }
+    // the TLS session stays up only if the whole response was read
+    if(!reusable) {
+        esp_http_client_close(client);
+    }
+    kept_client = client;
+    kept_config = config;
+}
+
+static void https_ota_received(size_t len)
+{
+    // range tasks report concurrently
+    size_t received = __atomic_add_fetch(&bytes_received, len, __ATOMIC_RELAXED);
+    last_ms = esp_timer_get_time() / 1000;
+    if(progress_cb) {
+        progress_cb(received, image_size);
+    }
+}
+
+static bool https_ota_read_range(esp_http_client_handle_t client, uint8_t *buf, uint32_t start, uint32_t end)
+{
+    uint32_t offset = start;
+    size_t fill = 0;
+    bool ok = true;
+    while(ok && offset < end) {
+        if(ranges_failed) {
+            ok = false;
+            break;
+        }
+        size_t want = SPI_FLASH_SEC_SIZE - fill;
+        if(want > end - offset - fill) {
+            want = end - offset - fill;
+        }
+        int len = esp_http_client_read(client, (char *)buf + fill, want);
+        if(len <= 0) {
+            log_e("Range Read Failed at %u", offset + fill);
+            ok = false;
+            break;
+        }
+        fill += len;
+        if(fill == SPI_FLASH_SEC_SIZE || offset + fill == end) {
+            ok = Update.writeAt(offset, buf, fill);
+            offset += fill;
+            fill = 0;
+        }
+        https_ota_received(len);
+    }
+    return ok;
+}
+
+static uint32_t https_ota_next_stripe(uint8_t index)
+{
+    // a stripe past what writeAt() holds for the slowest connection would be
+    // read back from the flash, so it waits until that one caught up
+    for(;;) {
+        xSemaphoreTake(stripe_lock, portMAX_DELAY);
+        uint32_t lowest = next_stripe;
+        for(uint8_t i = 0; i < parallel_ranges; i++) {
+            if(i != index && stripe_reading[i] < lowest) {
+                lowest = stripe_reading[i];
+            }
+        }
+        uint32_t start = next_stripe;
+        bool ready = start >= image_size || start + stripe_size <= lowest + UPDATE_REORDER_SECTORS * SPI_FLASH_SEC_SIZE;
+        if(ready) {
+            stripe_reading[index] = start < image_size ? start : UINT32_MAX;
+            next_stripe = start + stripe_size;
+        }
+        xSemaphoreGive(stripe_lock);
+        if(ready) {
+            return start;
+        }
+        if(ranges_failed) {
+            return UINT32_MAX;
+        }
+        vTaskDelay(1);
+    }
+}
+
+// with first the open response is the whole image, only its first stripe is read
+static bool https_ota_read_stripes(esp_http_client_handle_t client, uint8_t index, bool first)
+{
+    uint8_t *buf = (uint8_t *)malloc(SPI_FLASH_SEC_SIZE);
+    if(!buf) {
+        log_e("malloc failed");
+        return false;
+    }
+    bool ok = true;
+    if(first) {
+        ok = https_ota_read_range(client, buf, 0, stripe_size);
+        esp_http_client_close(client);
+    }
+    // every connection takes the next stripe nobody fetches yet, the
+    // connection stays open from one stripe to the next
+    while(ok && !ranges_failed) {
+        uint32_t start = https_ota_next_stripe(index);
+        if(start >= image_size) {
+            break;
+        }
+        uint32_t end = start + stripe_size < image_size ? start + stripe_size : image_size;
+        char header[32];
+        snprintf(header, sizeof(header), "bytes=%u-%u", start, end - 1);
+        esp_http_client_set_header(client, "Range", header);
+        if(esp_http_client_open(client, 0) != ESP_OK) {
+            log_e("Range Connection Failed");
+            ok = false;
+        } else if(esp_http_client_fetch_headers(client) < 0 || esp_http_client_get_status_code(client) != 206) {
+            log_e("Range Request Failed: HTTP Status %d", esp_http_client_get_status_code(client));
+            ok = false;
+        } else {
+            ok = https_ota_read_range(client, buf, start, end);
+        }
+    }
+    stripe_reading[index] = UINT32_MAX;
+    esp_http_client_delete_header(client, "Range");
+    free(buf);
+    return ok && !ranges_failed;
+}
+
+static void https_ota_range_task(void *param)
+{
+    HttpsOTARange_t *range = (HttpsOTARange_t *)param;
+    range->ok = false;
+    esp_http_client_handle_t client = esp_http_client_init(&config);
+    if(client) {
+        range->ok = https_ota_read_stripes(client, range->index, false);
+        esp_http_client_close(client);
+        esp_http_client_cleanup(client);
+    }
+    if(!range->ok) {
+        ranges_failed = true;
+    }
+    xEventGroupSetBits(ranges_done, 1 << range->index);
+    vTaskDelete(NULL);
+}
+
+static bool https_ota_download_ranges(esp_http_client_handle_t client)
+{
+    // stripes of whole sectors, small enough that the ones in flight on all
+    // connections fit the UPDATE_REORDER_SECTORS writeAt() hashes in order
+    uint32_t sectors = UPDATE_REORDER_SECTORS / parallel_ranges;
+    stripe_size = (sectors ? sectors : 1) * SPI_FLASH_SEC_SIZE;
+    // this response provides the first stripe
+    next_stripe = stripe_size;
+    stripe_reading[0] = 0;
+    for(uint8_t i = 1; i < parallel_ranges; i++) {
+        stripe_reading[i] = UINT32_MAX;
+    }
+    HttpsOTARange_t ranges[HTTPS_OTA_MAX_RANGES];
+    EventBits_t started = 0;
+    ranges_failed = false;
+    xEventGroupClearBits(ranges_done, 0xff);
+    for(uint8_t i = 1; i < parallel_ranges; i++) {
+        ranges[i].index = i;
+        if(xTaskCreatePinnedToCore(&https_ota_range_task, "https_ota_range", range_task.stack_size, &ranges[i], range_task.priority, NULL, range_task.core) != pdPASS) {
+            log_e("Couldn't create range task");
+            ranges_failed = true;
+            break;
+        }
+        started |= 1 << i;
+    }
+    bool ok = !ranges_failed && https_ota_read_stripes(client, 0, true);
+    if(!ok) {
+        ranges_failed = true;
+    }
+    if(started) {
+        xEventGroupWaitBits(ranges_done, started, pdTRUE, pdTRUE, portMAX_DELAY);
+    }
+    if(ranges_failed) {
+        if(Update.isRunning()) {
+            Update.abort();
+        }
+        return false;
+    }
+    if(!Update.end()) {
+        log_e("Update Failed: %s", Update.errorString());
+        return false;
+    }
+    return true;
+}
+
+static bool https_ota_resume(esp_http_client_handle_t client)
+{
+    // the checkpoint restored by begin() has the image up to resume() on the flash
+    uint32_t offset = Update.resume();
+    char header[32];
+    snprintf(header, sizeof(header), "bytes=%u-", offset);
+    esp_http_client_close(client);
+    esp_http_client_set_header(client, "Range", header);
+    bool opened = esp_http_client_open(client, 0) == ESP_OK;
+    int64_t content_length = opened ? esp_http_client_fetch_headers(client) : -1;
+    esp_http_client_delete_header(client, "Range");
+    if(!opened) {
+        log_e("Connection Failed");
+        return false;
+    }
+    int status_code = esp_http_client_get_status_code(client);
+    if(status_code != 206 || (image_size && content_length != (int64_t)(image_size - offset))) {
+        log_e("Resume at %u Failed: HTTP Status %d", offset, status_code);
+        return false;
+    }
+    return true;
+}
+
+static bool https_ota_download(esp_http_client_handle_t client)
+{
+    accept_ranges = false;
+    if(esp_http_client_open(client, 0) != ESP_OK) {
+        log_e("Connection Failed");
+        return false;
+    }
+    int64_t content_length = esp_http_client_fetch_headers(client);
+    int status_code = esp_http_client_get_status_code(client);
+    if(status_code != 200) {
+        log_e("HTTP Status %d", status_code);
+        return false;
+    }
+    image_size = content_length > 0 ? content_length : 0;
+    if(!Update.begin(image_size ? image_size : UPDATE_SIZE_UNKNOWN)) {
+        log_e("Update Begin Failed: %s", Update.errorString());
+        return false;
+    }
+    if(target_md5[0]) {
+        Update.setMD5(target_md5);
+    }
+    if(Update.resume() && !https_ota_resume(client)) {
+        // keeps the checkpoint for the next attempt
+        Update.abort();
+        return false;
+    }
+    // writeAt() can't continue a checkpoint, so a resumed image is one stream
+    if(parallel_ranges > 1 && !Update.resume() && accept_ranges && image_size >= parallel_ranges * SPI_FLASH_SEC_SIZE && ranges_done && stripe_lock) {
+        return https_ota_download_ranges(client);
+    }
+
+    // read straight into the sector buffer of the updater
+    size_t capacity;
+    uint8_t *buf;
+    while((buf = Update.getWriteBuffer(capacity)) && capacity) {
+        int len = esp_http_client_read(client, (char *)buf, capacity);
+        if(len < 0) {
+            log_e("Read Failed");
+            break;
+        }
+        if(len == 0) {
+            if(!image_size && esp_http_client_is_complete_data_received(client)) {
+                // without a Content-Length the image ends with the response
+                if(!Update.end(true)) {
+                    log_e("Update Failed: %s", Update.errorString());
+                    return false;
+                }
+                return true;
+            }
+            log_e("Connection Closed at %u", bytes_received);
+            break;
+        }
+        if(Update.commit(len) != (size_t)len) {
+            break;
+        }
+        https_ota_received(len);
+    }
+    if(Update.hasError()) {
+        log_e("Update Failed: %s", Update.errorString());
+        return false;
+    }
+    if(!Update.isFinished()) {
+        Update.abort();
+        return false;
+    }
+    if(!Update.end()) {
+        log_e("Update Failed: %s", Update.errorString());
+        return false;
+    }
+    return true;
+}
+
 void https_ota_task(void *param)
 {
-    if(ota_status) {
-        xEventGroupSetBits(ota_status, OTA_UPDATING_BIT);
-        xEventGroupClearBits(ota_status, OTA_IDLE_BIT);
+    bytes_received = 0;
+    image_size = 0;
+    start_ms = last_ms = esp_timer_get_time() / 1000;
+
+    bool ok = false;
+    const HttpsOTATaskParam_t *task_param = (const HttpsOTATaskParam_t *)param;
+    esp_http_client_handle_t client = https_ota_client(task_param->config);
+    if(client) {
+        ok = https_ota_download(client);
+        https_ota_release(client, ok && esp_http_client_is_complete_data_received(client));
     }
-    esp_err_t ret = esp_https_ota((const esp_http_client_config_t *)param);
-    if(ret == ESP_OK) {
+    if(ok) {
         if(ota_status) {
             xEventGroupClearBits(ota_status, OTA_UPDATING_BIT);
             xEventGroupSetBits(ota_status, OTA_SUCCESS_BIT);
@@ -56,6 +416,11 @@ void https_ota_task(void *param)
             xEventGroupSetBits(ota_status, OTA_FAIL_BIT);
         }
     }
+    if(task_param->is_static) {
+        // a deleted task is only cleaned up later by the idle task, so it waits
+        // here to be deleted by the next begin() before its TCB is reused
+        vTaskSuspend(NULL);
+    }
     vTaskDelete(NULL);
 }
 
@@ -79,13 +444,133 @@ HttpsOTAStatus_t HttpsOTAUpdateClass::status()
     return HTTPS_OTA_ERR;
 }
 
+size_t HttpsOTAUpdateClass::bytesReceived()
+{
+    return bytes_received;
+}
+
+size_t HttpsOTAUpdateClass::imageSize()
+{
+    return image_size;
+}
+
+uint32_t HttpsOTAUpdateClass::throughput()
+{
+    uint32_t elapsed = last_ms - start_ms;
+    if(!elapsed) {
+        return 0;
+    }
+    return (uint64_t)bytes_received * 1000 / elapsed;
+}
+
 void HttpsOTAUpdateClass::onHttpEvent(HttpEventCb cbEvent)
 {
     cb = cbEvent;
 }
 
-void HttpsOTAUpdateClass::begin(const char *url, const char *cert_pem, bool skip_cert_common_name_check)
+void HttpsOTAUpdateClass::onProgress(HttpsOTAProgressCb cbProgress)
+{
+    progress_cb = cbProgress;
+}
+
+void HttpsOTAUpdateClass::setRxBufferSize(int size)
+{
+    config.buffer_size = size;
+}
+
+bool HttpsOTAUpdateClass::setMD5(const char *expected_md5)
+{
+    if(!expected_md5) {
+        target_md5[0] = 0;
+        return true;
+    }
+    if(strlen(expected_md5) != 32) {
+        return false;
+    }
+    strcpy(target_md5, expected_md5);
+    return true;
+}
+
+bool HttpsOTAUpdateClass::setParallelRanges(uint8_t count)
+{
+    if(!count || count > HTTPS_OTA_MAX_RANGES || status() == HTTPS_OTA_UPDATING) {
+        return false;
+    }
+    if(count > 1 && !ranges_done) {
+        ranges_done = xEventGroupCreate();
+        if(!ranges_done) {
+            log_e("Range Event Group Create Failed");
+            return false;
+        }
+    }
+    if(count > 1 && !stripe_lock) {
+        stripe_lock = xSemaphoreCreateMutex();
+        if(!stripe_lock) {
+            log_e("Range Mutex Create Failed");
+            return false;
+        }
+    }
+    parallel_ranges = count;
+    return true;
+}
+
+void HttpsOTAUpdateClass::setKeepAlive(bool enable)
 {
+    keep_alive = enable;
+    config.keep_alive_enable = enable;
+    // a client in use isn't kept, https_ota_release() closes it
+    if(!enable && kept_client) {
+        esp_http_client_close(kept_client);
+        esp_http_client_cleanup(kept_client);
+        kept_client = NULL;
+    }
+}
+
+int HttpsOTAUpdateClass::fetch(const char *url, const char *cert_pem, char *buf, size_t len, bool skip_cert_common_name_check)
+{
+    if(status() == HTTPS_OTA_UPDATING) {
+        log_w("OTA Already Running");
+        return -1;
+    }
+    config.url = url;
+    config.cert_pem = cert_pem;
+    config.skip_cert_common_name_check = skip_cert_common_name_check;
+    config.event_handler = http_event_handler;
+
+    esp_http_client_handle_t client = https_ota_client(&config);
+    if(!client) {
+        return -1;
+    }
+    int total = -1;
+    if(esp_http_client_open(client, 0) != ESP_OK) {
+        log_e("Connection Failed");
+    } else if(esp_http_client_fetch_headers(client) < 0 || esp_http_client_get_status_code(client) != 200) {
+        log_e("HTTP Status %d", esp_http_client_get_status_code(client));
+    } else {
+        total = 0;
+        while((size_t)total < len) {
+            int read = esp_http_client_read(client, buf + total, len - total);
+            if(read <= 0) {
+                break;
+            }
+            total += read;
+        }
+        // what doesn't fit is dropped so the connection can be reused
+        if(!esp_http_client_is_complete_data_received(client)) {
+            int flushed = 0;
+            esp_http_client_flush_response(client, &flushed);
+        }
+    }
+    https_ota_release(client, total >= 0 && esp_http_client_is_complete_data_received(client));
+    return total;
+}
+
+void HttpsOTAUpdateClass::begin(const char *url, const char *cert_pem, bool skip_cert_common_name_check, const HttpsOTATaskConfig_t *task_config)
+{
+    if(status() == HTTPS_OTA_UPDATING) {
+        log_w("OTA Already Running");
+        return;
+    }
     config.url = url;
     config.cert_pem = cert_pem; 
     config.skip_cert_common_name_check = skip_cert_common_name_check;
@@ -98,9 +583,39 @@ void HttpsOTAUpdateClass::begin(const char *url, const char *cert_pem, bool skip
         }
         xEventGroupSetBits(ota_status, OTA_IDLE_BIT);
     }
+    // set before the task runs so status() never reports the previous result
+    if(ota_status) {
+        xEventGroupSetBits(ota_status, OTA_UPDATING_BIT);
+        xEventGroupClearBits(ota_status, OTA_IDLE_BIT | OTA_SUCCESS_BIT | OTA_FAIL_BIT);
+    }
  
-    if (xTaskCreate(&https_ota_task, "https_ota_task", OTA_TASK_STACK_SIZE, &config, 5, NULL) != pdPASS) {
+    HttpsOTATaskConfig_t task = HTTPS_OTA_TASK_CONFIG_DEFAULT();
+    if(task_config) {
+        task = *task_config;
+    }
+    // range tasks can't share a caller provided stack
+    range_task = task;
+    range_task.stack = NULL;
+    if(static_task) {
+        while(eTaskGetState(static_task) != eSuspended) {
+            vTaskDelay(1);
+        }
+        vTaskDelete(static_task);
+        static_task = NULL;
+    }
+    bool created;
+    if(task.stack) {
+        static_task = xTaskCreateStaticPinnedToCore(&https_ota_task, "https_ota_task", task.stack_size, (void *)&static_task_param, task.priority, task.stack, &static_task_tcb, task.core);
+        created = static_task != NULL;
+    } else {
+        created = xTaskCreatePinnedToCore(&https_ota_task, "https_ota_task", task.stack_size, (void *)&dynamic_task_param, task.priority, NULL, task.core) == pdPASS;
+    }
+    if (!created) {
         log_e("Couldn't create ota task\n"); 
+        if(ota_status) {
+            xEventGroupClearBits(ota_status, OTA_UPDATING_BIT);
+            xEventGroupSetBits(ota_status, OTA_FAIL_BIT);
+        }
     }
 }
 
@@ -1,8 +1,32 @@
 #ifndef HTPSPOTUADATE_H
 #define HTPSPOTUADATE_H
+#include <stddef.h>
+#include <stdint.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 #include "esp_http_client.h"
 #define HttpEvent_t esp_http_client_event_t
 
+#define OTA_TASK_STACK_SIZE 9216
+#define OTA_TASK_PRIORITY   5
+#define HTTPS_OTA_MAX_RANGES 4
+
+/*
+  Where and how the OTA task runs
+  stack optionally points to stack_size bytes owned by the caller, kept until the next begin(),
+  e.g. a static array in internal RAM or a heap_caps_malloc(MALLOC_CAP_SPIRAM) buffer
+  A PSRAM stack needs CONFIG_SPIRAM_ALLOW_STACK_EXTERNAL_MEMORY
+*/
+typedef struct
+{
+    uint32_t stack_size;
+    UBaseType_t priority;
+    BaseType_t core;        // tskNO_AFFINITY lets the scheduler pick
+    StackType_t *stack;     // NULL allocates the stack
+}HttpsOTATaskConfig_t;
+
+#define HTTPS_OTA_TASK_CONFIG_DEFAULT() { OTA_TASK_STACK_SIZE, OTA_TASK_PRIORITY, tskNO_AFFINITY, NULL }
+
 typedef enum
 {
     HTTPS_OTA_IDLE,
@@ -15,9 +39,54 @@ typedef enum
 class HttpsOTAUpdateClass {
 
     public:
-    void begin(const char *url, const char *cert_pem, bool skip_cert_common_name_check = true);
+    void begin(const char *url, const char *cert_pem, bool skip_cert_common_name_check = true, const HttpsOTATaskConfig_t *task_config = NULL);
     void onHttpEvent(void (*http_event_cb_t)(HttpEvent_t *));
+    /*
+      Called from the OTA task after every read with the bytes received so far
+      and the image size (0 if the server didn't send a Content-Length)
+    */
+    void onProgress(void (*progress_cb_t)(size_t, size_t));
+    /*
+      Size of the esp_http_client receive buffer, 0 keeps its default
+      A buffer that holds a whole TLS record lets each read fill more of a flash sector
+    */
+    void setRxBufferSize(int size);
+    /*
+      Expected MD5 of the image (hexString), checked by Update.end()
+      A signing key set with Update.signingKey() is checked the same way
+    */
+    bool setMD5(const char *expected_md5);
+    /*
+      Keeps the HTTP client and its TLS connection open after a request,
+      so the next begin() or fetch() to the same server skips the handshake
+      The connection is only kept if the response was read completely
+      and the server didn't close it
+    */
+    void setKeepAlive(bool enable);
+    /*
+      Downloads the image as count byte ranges over as many connections at once,
+      if the server sends Accept-Ranges and the image size, a single stream otherwise
+      Each connection requests the next stripe of a few sectors in turn
+      Every extra range runs in its own task with the stack size, priority and core
+      given to begin() and needs its own TLS session
+      The HTTP event and progress callbacks are then called from all of them
+      An update resumed with Update.setResumable() is always a single stream
+    */
+    bool setParallelRanges(uint8_t count);
+    /*
+      Reads a small resource like a manifest into buf, blocking
+      Returns the bytes stored, -1 on error or while an OTA is running
+      A longer response is truncated to len
+    */
+    int fetch(const char *url, const char *cert_pem, char *buf, size_t len, bool skip_cert_common_name_check = true);
     HttpsOTAStatus_t status();
+
+    size_t bytesReceived();
+    size_t imageSize();
+    /*
+      Average download rate of the running or last update, in bytes per second
+    */
+    uint32_t throughput();
 };
 
 extern HttpsOTAUpdateClass HttpsOTA;
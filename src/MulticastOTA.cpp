@@ -0,0 +1,453 @@
+#include "MulticastOTA.h"
+#include <errno.h>
+#include "lwip/sockets.h"
+#include "esp_system.h"
+#include "esp_spi_flash.h"
+
+#define MULTICAST_OTA_MAGIC       "UMC"
+#define MULTICAST_OTA_HEADER_SIZE 12
+#define MULTICAST_OTA_ANNOUNCE_SIZE (MULTICAST_OTA_HEADER_SIZE + 22 + UPDATE_SIGNATURE_MAX_SIZE)
+#define MULTICAST_OTA_PACKET_SIZE (MULTICAST_OTA_HEADER_SIZE + MULTICAST_OTA_CHUNK_SIZE > MULTICAST_OTA_ANNOUNCE_SIZE \
+    ? MULTICAST_OTA_HEADER_SIZE + MULTICAST_OTA_CHUNK_SIZE : MULTICAST_OTA_ANNOUNCE_SIZE)
+#define MULTICAST_OTA_NACK_SECTORS 256
+#define MULTICAST_OTA_NACK_MS     200
+
+#define MULTICAST_OTA_ANNOUNCE    0
+#define MULTICAST_OTA_DATA        1
+#define MULTICAST_OTA_NACK        2
+
+#define MULTICAST_OTA_REPAIRING   0x01  // announce flag, the sender went through the whole image
+
+static uint32_t _le32(const uint8_t *p){
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void _put32(uint8_t *p, uint32_t v){
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static size_t _header(uint8_t *packet, uint8_t type, uint32_t session, uint32_t arg){
+    memcpy(packet, MULTICAST_OTA_MAGIC, 3);
+    packet[3] = type;
+    _put32(packet + 4, session);
+    _put32(packet + 8, arg);
+    return MULTICAST_OTA_HEADER_SIZE;
+}
+
+static bool _sendTo(int sock, const uint8_t *packet, size_t len, const struct sockaddr_in *to){
+    //lwIP runs out of buffers for a moment when the WiFi driver falls behind
+    for(int tries = 0; tries < 50; tries++){
+        if(sendto(sock, packet, len, 0, (const struct sockaddr*)to, sizeof(*to)) == (int)len){
+            return true;
+        }
+        if(errno != ENOMEM && errno != EAGAIN){
+            break;
+        }
+        delay(1);
+    }
+    log_e("sendto failed: %d", errno);
+    return false;
+}
+
+MulticastOTAClass::MulticastOTAClass()
+: _group(0)
+, _port(MULTICAST_OTA_PORT)
+, _rate(0)
+, _sent(0)
+, _paceStart(0)
+, _repairs(0)
+, _signatureLen(0)
+{
+    setGroup(MULTICAST_OTA_GROUP, MULTICAST_OTA_PORT);
+}
+
+bool MulticastOTAClass::setGroup(const char *address, uint16_t port){
+    struct in_addr addr;
+    if(!address || !inet_aton(address, &addr) || !port){
+        return false;
+    }
+    _group = addr.s_addr;
+    _port = port;
+    return true;
+}
+
+void MulticastOTAClass::setRate(uint32_t packetsPerSecond){
+    _rate = packetsPerSecond;
+}
+
+bool MulticastOTAClass::setSignature(const uint8_t *signature, size_t len){
+    _signatureLen = 0;
+    if(len > sizeof(_signature) || (len && !signature)){
+        return false;
+    }
+    memcpy(_signature, signature, len);
+    _signatureLen = len;
+    return true;
+}
+
+int MulticastOTAClass::_open(bool receiver){
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if(sock < 0){
+        log_e("socket failed: %d", errno);
+        return -1;
+    }
+    int on = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    //the sender takes any port, receivers answer to where the data came from
+    addr.sin_port = receiver ? htons(_port) : 0;
+    bool ok = bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+    if(ok && receiver){
+        struct ip_mreq mreq = {};
+        mreq.imr_multiaddr.s_addr = _group;
+        mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+        struct timeval timeout = { 0, MULTICAST_OTA_NACK_MS * 1000 / 2 };
+        ok = !setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq))
+            && !setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    } else if(ok){
+        //stays on the local network
+        uint8_t ttl = 1;
+        ok = !setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    }
+    if(!ok){
+        log_e("socket setup failed: %d", errno);
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+void MulticastOTAClass::_pace(){
+    if(!_rate){
+        return;
+    }
+    _sent++;
+    uint32_t due = (uint64_t)_sent * 1000 / _rate;
+    uint32_t elapsed = millis() - _paceStart;
+    if(due > elapsed){
+        delay(due - elapsed);
+    }
+}
+
+bool MulticastOTAClass::_announce(int sock, uint32_t session, size_t size, int command, const uint8_t *md5, uint8_t flags){
+    uint8_t packet[MULTICAST_OTA_ANNOUNCE_SIZE];
+    size_t len = _header(packet, MULTICAST_OTA_ANNOUNCE, session, size);
+    packet[len++] = command;
+    packet[len++] = command >> 8;
+    packet[len++] = flags;
+    packet[len++] = 0;
+    packet[len++] = _signatureLen;
+    packet[len++] = _signatureLen >> 8;
+    memcpy(packet + len, md5, 16);
+    len += 16;
+    memcpy(packet + len, _signature, _signatureLen);
+    len += _signatureLen;
+    struct sockaddr_in to = {};
+    to.sin_family = AF_INET;
+    to.sin_addr.s_addr = _group;
+    to.sin_port = htons(_port);
+    return _sendTo(sock, packet, len, &to);
+}
+
+bool MulticastOTAClass::_sendSector(int sock, uint32_t session, uint32_t sector, size_t size, THandlerFunction_Read &reader, uint8_t *buf){
+    uint32_t offset = sector * SPI_FLASH_SEC_SIZE;
+    size_t len = size - offset < SPI_FLASH_SEC_SIZE ? size - offset : SPI_FLASH_SEC_SIZE;
+    uint8_t *packet = buf + SPI_FLASH_SEC_SIZE;
+    if(!reader(offset, buf, len)){
+        log_e("read failed at 0x%x", offset);
+        return false;
+    }
+    struct sockaddr_in to = {};
+    to.sin_family = AF_INET;
+    to.sin_addr.s_addr = _group;
+    to.sin_port = htons(_port);
+    for(size_t part = 0; part < len; part += MULTICAST_OTA_CHUNK_SIZE){
+        size_t chunk = len - part < MULTICAST_OTA_CHUNK_SIZE ? len - part : MULTICAST_OTA_CHUNK_SIZE;
+        size_t header = _header(packet, MULTICAST_OTA_DATA, session, offset + part);
+        memcpy(packet + header, buf + part, chunk);
+        if(!_sendTo(sock, packet, header + chunk, &to)){
+            return false;
+        }
+        _pace();
+    }
+    return true;
+}
+
+void MulticastOTAClass::_pollNacks(int sock, uint32_t session, uint32_t *pending, size_t sectors, uint32_t &lastNack){
+    uint8_t packet[MULTICAST_OTA_HEADER_SIZE + MULTICAST_OTA_NACK_SECTORS / 8];
+    int len;
+    while((len = recv(sock, packet, sizeof(packet), MSG_DONTWAIT)) >= (int)sizeof(packet)){
+        if(memcmp(packet, MULTICAST_OTA_MAGIC, 3) || packet[3] != MULTICAST_OTA_NACK || _le32(packet + 4) != session){
+            continue;
+        }
+        uint32_t first = _le32(packet + 8);
+        const uint8_t *map = packet + MULTICAST_OTA_HEADER_SIZE;
+        for(uint32_t i = 0; i < MULTICAST_OTA_NACK_SECTORS && first + i < sectors; i++){
+            if(map[i / 8] & (1 << (i % 8))){
+                pending[(first + i) / 32] |= 1UL << ((first + i) % 32);
+            }
+        }
+        lastNack = millis();
+    }
+}
+
+bool MulticastOTAClass::send(size_t size, THandlerFunction_Read reader, int command, uint32_t quietMs){
+    //receivers use writeAt(), compressed images and U_DELTA or U_BUNDLE don't fit that
+    if(!size || size == UPDATE_SIZE_UNKNOWN || !reader || (command != U_FLASH && command != U_SPIFFS)){
+        return false;
+    }
+    size_t sectors = (size + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE;
+    //one sector to read into and the packet built from it
+    uint8_t *buf = (uint8_t*)malloc(SPI_FLASH_SEC_SIZE + MULTICAST_OTA_PACKET_SIZE);
+    uint32_t *pending = (uint32_t*)calloc((sectors + 31) / 32, sizeof(uint32_t));
+    if(!buf || !pending){
+        log_e("malloc failed");
+        free(buf);
+        free(pending);
+        return false;
+    }
+    //receivers need the MD5 before the first sector
+    MD5Builder md5;
+    md5.begin();
+    bool ok = true;
+    for(uint32_t offset = 0; ok && offset < size; offset += SPI_FLASH_SEC_SIZE){
+        size_t len = size - offset < SPI_FLASH_SEC_SIZE ? size - offset : SPI_FLASH_SEC_SIZE;
+        ok = reader(offset, buf, len);
+        md5.add(buf, len);
+    }
+    md5.calculate();
+    uint8_t digest[16];
+    md5.getBytes(digest);
+    int sock = ok ? _open(false) : -1;
+    if(sock < 0){
+        free(buf);
+        free(pending);
+        return false;
+    }
+
+    uint32_t session = esp_random() | 1;
+    uint32_t lastNack = 0;
+    _repairs = 0;
+    _sent = 0;
+    _paceStart = millis();
+    for(int i = 0; ok && i < 3; i++){
+        ok = _announce(sock, session, size, command, digest, 0);
+    }
+    //latecomers learn about the session from the announcements in between
+    for(uint32_t sector = 0; ok && sector < sectors; sector++){
+        ok = _sendSector(sock, session, sector, size, reader, buf);
+        if(ok && sector % 16 == 15){
+            ok = _announce(sock, session, size, command, digest, 0);
+        }
+        _pollNacks(sock, session, pending, sectors, lastNack);
+    }
+
+    //repeat what was asked for until the receivers are quiet
+    lastNack = millis();
+    uint32_t lastBeat = 0;
+    uint32_t next = 0;
+    while(ok && millis() - lastNack < quietMs){
+        _pollNacks(sock, session, pending, sectors, lastNack);
+        size_t scanned = 0;
+        for(; scanned < sectors && !(pending[next / 32] & (1UL << (next % 32))); scanned++){
+            next = (next + 1) % sectors;
+        }
+        if(scanned < sectors){
+            pending[next / 32] &= ~(1UL << (next % 32));
+            ok = _sendSector(sock, session, next, size, reader, buf);
+            _repairs++;
+            continue;
+        }
+        //tells receivers that missed the end to ask now
+        if(millis() - lastBeat >= MULTICAST_OTA_NACK_MS / 2){
+            ok = _announce(sock, session, size, command, digest, MULTICAST_OTA_REPAIRING);
+            lastBeat = millis();
+        }
+        delay(5);
+    }
+    close(sock);
+    free(buf);
+    free(pending);
+    return ok;
+}
+
+bool MulticastOTAClass::send(const esp_partition_t *partition, size_t size, int command, uint32_t quietMs){
+    if(!partition || size > partition->size){
+        return false;
+    }
+    return send(size, [partition](uint32_t offset, uint8_t *data, size_t len){
+        return ESP.partitionRead(partition, offset, (uint32_t*)data, len);
+    }, command, quietMs);
+}
+
+bool MulticastOTAClass::receive(uint32_t timeoutMs){
+    if(Update.isRunning()){
+        log_w("already running");
+        return false;
+    }
+    int sock = _open(true);
+    if(sock < 0){
+        return false;
+    }
+    uint8_t *packet = (uint8_t*)malloc(MULTICAST_OTA_PACKET_SIZE);
+    uint8_t *slots = (uint8_t*)malloc(MULTICAST_OTA_SLOTS * SPI_FLASH_SEC_SIZE);
+    if(!packet || !slots){
+        log_e("malloc failed");
+        free(packet);
+        free(slots);
+        close(sock);
+        return false;
+    }
+    int32_t slotSector[MULTICAST_OTA_SLOTS];
+    uint8_t slotChunks[MULTICAST_OTA_SLOTS];    // bit per chunk received
+    for(int i = 0; i < MULTICAST_OTA_SLOTS; i++){
+        slotSector[i] = -1;
+    }
+    uint32_t *done = NULL;
+    size_t sectors = 0;
+    size_t left = 0;
+    size_t size = 0;
+    uint32_t session = 0;
+    uint32_t highest = 0;       // sectors below it the sender already went past
+    bool repairing = false;
+    struct sockaddr_in sender = {};
+    uint32_t last = millis();
+    uint32_t nextNack = 0;
+    bool ok = false;
+    bool failed = false;
+
+    while(!failed && millis() - last < timeoutMs){
+        struct sockaddr_in from;
+        socklen_t fromLen = sizeof(from);
+        int len = recvfrom(sock, packet, MULTICAST_OTA_PACKET_SIZE, 0, (struct sockaddr*)&from, &fromLen);
+        if(len >= MULTICAST_OTA_HEADER_SIZE && !memcmp(packet, MULTICAST_OTA_MAGIC, 3)){
+            uint8_t type = packet[3];
+            uint32_t id = _le32(packet + 4);
+            uint32_t arg = _le32(packet + 8);
+            const uint8_t *body = packet + MULTICAST_OTA_HEADER_SIZE;
+            size_t bodyLen = len - MULTICAST_OTA_HEADER_SIZE;
+            if(type == MULTICAST_OTA_ANNOUNCE && !session && bodyLen >= 22){
+                int command = body[0] | (body[1] << 8);
+                size_t sigLen = body[4] | (body[5] << 8);
+                char md5[33];
+                for(int i = 0; i < 16; i++){
+                    sprintf(md5 + i * 2, "%02x", body[6 + i]);
+                }
+                // never anything else, a bundle or a compressed image is no sector-for-sector copy
+                if(command != U_FLASH && command != U_SPIFFS){
+                    log_e("session %08x announces command %d", id, command);
+                    failed = true;
+                    break;
+                }
+                if(bodyLen < 22 + sigLen || !Update.begin(arg, command)){
+                    log_e("can't take session %08x: %s", id, Update.errorString());
+                    failed = true;
+                    break;
+                }
+                Update.setMD5(md5);
+                if(sigLen){
+                    Update.setSignature(body + 22, sigLen);
+                }
+                size = arg;
+                sectors = left = (size + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE;
+                done = (uint32_t*)calloc((sectors + 31) / 32, sizeof(uint32_t));
+                if(!done){
+                    log_e("malloc failed");
+                    failed = true;
+                    break;
+                }
+                session = id;
+                sender = from;
+                last = millis();
+                log_d("session %08x: %u bytes", session, size);
+            } else if(type == MULTICAST_OTA_ANNOUNCE && session && id == session){
+                repairing = bodyLen >= 22 && (body[2] & MULTICAST_OTA_REPAIRING);
+                last = millis();
+            } else if(type == MULTICAST_OTA_DATA && session && id == session){
+                last = millis();
+                uint32_t sector = arg / SPI_FLASH_SEC_SIZE;
+                if(arg >= size || arg % MULTICAST_OTA_CHUNK_SIZE || bodyLen > MULTICAST_OTA_CHUNK_SIZE
+                || (bodyLen != MULTICAST_OTA_CHUNK_SIZE && arg + bodyLen != size) || (done[sector / 32] & (1UL << (sector % 32)))){
+                    continue;
+                }
+                if(sector >= highest){
+                    highest = sector;
+                }
+                //the slot of this sector, else a free one (-1) or the one furthest behind
+                int slot = 0;
+                for(int i = 1; i < MULTICAST_OTA_SLOTS && slotSector[slot] != (int32_t)sector; i++){
+                    if(slotSector[i] == (int32_t)sector || slotSector[i] < slotSector[slot]){
+                        slot = i;
+                    }
+                }
+                if(slotSector[slot] != (int32_t)sector){
+                    slotSector[slot] = sector;
+                    slotChunks[slot] = 0;
+                }
+                uint8_t *data = slots + slot * SPI_FLASH_SEC_SIZE;
+                memcpy(data + arg % SPI_FLASH_SEC_SIZE, body, bodyLen);
+                slotChunks[slot] |= 1 << (arg % SPI_FLASH_SEC_SIZE / MULTICAST_OTA_CHUNK_SIZE);
+                size_t sectorLen = size - sector * SPI_FLASH_SEC_SIZE;
+                if(sectorLen > SPI_FLASH_SEC_SIZE){
+                    sectorLen = SPI_FLASH_SEC_SIZE;
+                }
+                size_t chunks = (sectorLen + MULTICAST_OTA_CHUNK_SIZE - 1) / MULTICAST_OTA_CHUNK_SIZE;
+                if(slotChunks[slot] == (1 << chunks) - 1){
+                    slotSector[slot] = -1;
+                    if(!Update.writeAt(sector * SPI_FLASH_SEC_SIZE, data, sectorLen)){
+                        failed = true;
+                        break;
+                    }
+                    done[sector / 32] |= 1UL << (sector % 32);
+                    if(!--left){
+                        ok = Update.end();
+                        break;
+                    }
+                }
+            }
+        }
+
+        //ask for what the sender went past, or for everything once it says it's through
+        uint32_t limit = repairing ? sectors : highest;
+        if(session && (int32_t)(millis() - nextNack) >= 0){
+            uint32_t first = 0;
+            while(first < limit && (done[first / 32] & (1UL << (first % 32)))){
+                first++;
+            }
+            if(first < limit){
+                uint8_t *map = packet + _header(packet, MULTICAST_OTA_NACK, session, first);
+                memset(map, 0, MULTICAST_OTA_NACK_SECTORS / 8);
+                for(uint32_t i = 0; i < MULTICAST_OTA_NACK_SECTORS && first + i < limit; i++){
+                    if(!(done[(first + i) / 32] & (1UL << ((first + i) % 32)))){
+                        map[i / 8] |= 1 << (i % 8);
+                    }
+                }
+                _sendTo(sock, packet, MULTICAST_OTA_HEADER_SIZE + MULTICAST_OTA_NACK_SECTORS / 8, &sender);
+                //spread the NACKs of the receivers a little
+                nextNack = millis() + MULTICAST_OTA_NACK_MS + esp_random() % (MULTICAST_OTA_NACK_MS / 2);
+            }
+        }
+    }
+    if(!ok){
+        if(!failed && !left && session){
+            log_e("Update Failed: %s", Update.errorString());
+        } else if(!failed){
+            log_e("timeout with %u of %u sectors missing", left, sectors);
+        }
+        if(Update.isRunning()){
+            Update.abort();
+        }
+    }
+    close(sock);
+    free(done);
+    free(slots);
+    free(packet);
+    return ok;
+}
+
+MulticastOTAClass MulticastOTA;
@@ -0,0 +1,102 @@
+#ifndef MULTICASTOTA_H
+#define MULTICASTOTA_H
+
+#include <Arduino.h>
+#include <functional>
+#include "esp_partition.h"
+#include "Update.h"
+
+#define MULTICAST_OTA_GROUP      "239.255.77.77"
+#define MULTICAST_OTA_PORT       3233
+#define MULTICAST_OTA_CHUNK_SIZE 1024   // payload of a data packet, a quarter sector
+#define MULTICAST_OTA_SLOTS      4      // sectors a receiver assembles at once
+
+/*
+  Sends one image to every device on the LAN over UDP multicast, so a site
+  downloads it once no matter how many devices it has
+  The sender streams the image sector by sector and announces the session
+  (size, command, MD5 and signature) in between, receivers join any time,
+  write whole sectors with Update.writeAt() and ask for the sectors they
+  missed with NACKs, which are multicast again for everybody
+  Update.end() checks MD5 and, with a signing key set on the receiver,
+  the signature, exactly as for a download
+  All packets start with "UMC", a type byte and the session id:
+    announce: image size, command (uint16), flags, reserved byte, signature length (uint16), MD5, signature
+    data:     offset, up to MULTICAST_OTA_CHUNK_SIZE bytes of the image
+    nack:     first sector, bitmap of that and the next 255 sectors still missing
+  Both calls block, run them from a task of your own if the loop has to go on
+  Nothing authenticates the sender: without a signing key on the receiver
+  (UPDATE_SIGNING_KEY or Update.signingKey()) any host on the LAN that
+  announces a session first gets to flash the device. The MD5 only guards
+  against corruption, it comes from the same packets as the image
+  receive() only accepts U_FLASH and U_SPIFFS sessions
+*/
+class MulticastOTAClass {
+  public:
+    typedef std::function<bool(uint32_t, uint8_t*, size_t)> THandlerFunction_Read;
+
+    MulticastOTAClass();
+
+    /*
+      Group and port used by both sides, MULTICAST_OTA_GROUP:MULTICAST_OTA_PORT by default
+    */
+    bool setGroup(const char *address, uint16_t port = MULTICAST_OTA_PORT);
+
+    /*
+      Limits the sender to packetsPerSecond, 0 sends as fast as the stack takes them
+      Cheap access points drop multicast bursts, which only turns into repairs
+    */
+    void setRate(uint32_t packetsPerSecond);
+
+    /*
+      Signature of the image, announced to the receivers for Update.setSignature()
+    */
+    bool setSignature(const uint8_t *signature, size_t len);
+
+    /*
+      Sends size bytes of the image, read at any offset through reader
+      The image is read once up front for its MD5, then sent in order and
+      sectors are repeated as long as NACKs come in, until none came for quietMs
+      command is U_FLASH or U_SPIFFS, sent images can't be compressed
+      Returns false if the socket can't be set up or the reader fails
+    */
+    bool send(size_t size, THandlerFunction_Read reader, int command = U_FLASH, uint32_t quietMs = 2000);
+
+    /*
+      Same as above for an image stored in a partition, e.g. the running app
+    */
+    bool send(const esp_partition_t *partition, size_t size, int command = U_FLASH, uint32_t quietMs = 2000);
+
+    /*
+      Joins the group and writes the first session announced with Update,
+      which must not be running
+      Returns true once Update.end() succeeded, false if it failed or nothing
+      came from the sender for timeoutMs
+    */
+    bool receive(uint32_t timeoutMs = 30000);
+
+    /*
+      Sectors the last send() had to repeat
+    */
+    size_t repairs(){ return _repairs; }
+
+  private:
+    int _open(bool receiver);
+    bool _announce(int sock, uint32_t session, size_t size, int command, const uint8_t *md5, uint8_t flags);
+    bool _sendSector(int sock, uint32_t session, uint32_t sector, size_t size, THandlerFunction_Read &reader, uint8_t *buf);
+    void _pollNacks(int sock, uint32_t session, uint32_t *pending, size_t sectors, uint32_t &lastNack);
+    void _pace();
+
+    uint32_t _group;            // network byte order
+    uint16_t _port;
+    uint32_t _rate;
+    uint32_t _sent;             // packets since the last _pace() reset
+    uint32_t _paceStart;
+    size_t _repairs;
+    uint8_t _signature[UPDATE_SIGNATURE_MAX_SIZE];
+    size_t _signatureLen;
+};
+
+extern MulticastOTAClass MulticastOTA;
+
+#endif
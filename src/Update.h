@@ -3,8 +3,21 @@
 
 #include <Arduino.h>
 #include <MD5Builder.h>
+#include <FS.h>
 #include <functional>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
 #include "esp_partition.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "esp_rom_md5.h"
+#include "mbedtls/pk.h"
+#include "mbedtls/sha256.h"
+#include "DeltaPatch.h"
+#include "HeatshrinkDecoder.h"
+#include "ChunkManifest.h"
 
 #define UPDATE_ERROR_OK                 (0)
 #define UPDATE_ERROR_WRITE              (1)
@@ -24,18 +37,80 @@
 #define UPDATE_ERROR_PARSE_PUBLIC_KEY       (14)
 #define UPDATE_ERROR_SIGNATURE_NOT_VALID    (15)
 #define UPDATE_ERROR_SIGNATURE_VERIFICATION (16)
+#define UPDATE_ERROR_PATCH                  (17)
+#define UPDATE_ERROR_DECOMPRESS             (18)
+#define UPDATE_ERROR_MANIFEST               (19)
+#define UPDATE_ERROR_CHUNK_HASH             (20)
+#define UPDATE_ERROR_BUNDLE                 (21)
+#define UPDATE_ERROR_SECTION_HASH           (22)
 
 #define UPDATE_SIZE_UNKNOWN 0xFFFFFFFF
 
+#define UPDATE_POLL_ERROR    (-1)   // the update was aborted, see getError()
+#define UPDATE_POLL_PENDING  (0)    // more data expected, call poll() again
+#define UPDATE_POLL_DONE     (1)    // all data written, call end()
+
 #define U_FLASH   0
 #define U_SPIFFS  100
 #define U_AUTH    200
+#define U_DELTA   300
+#define U_BUNDLE  400
 
 #define ENCRYPTED_BLOCK_SIZE 16
 
+#define UPDATE_SIGNATURE_MAX_SIZE 512   // RSA-4096
+
+/*
+  U_BUNDLE stream: "UBN\x01", section count, 3 reserved bytes, then for each section
+  command (U_FLASH, U_DELTA or U_SPIFFS, uint16 little endian), 2 reserved bytes,
+  size (uint32), partition label (UPDATE_BUNDLE_LABEL_SIZE bytes, NUL padded,
+  ignored for the app), SHA-256 of the section bytes, followed by the section itself
+  Each section is written like a begin() of its own, so it may be compressed or
+  carry a manifest, and its hash is checked as soon as it is complete
+  The boot partition only changes in end(), after every section checked out;
+  MD5 and signature then cover the whole bundle
+*/
+#define UPDATE_BUNDLE_MAGIC        "UBN\x01"
+#define UPDATE_BUNDLE_HEADER_SIZE  8
+#define UPDATE_BUNDLE_SECTION_SIZE 64
+#define UPDATE_BUNDLE_LABEL_SIZE   24
+
+#define UPDATE_PIPELINE_MAX_BUFFERS 8
+#define UPDATE_PIPELINE_STACK_SIZE  4096
+#define UPDATE_ERASE_STACK_SIZE     2048
+#define UPDATE_END_STACK_SIZE       8192    // signature checks need the room
+#define UPDATE_REORDER_SECTORS      4       // writeAt() sectors held for hashing in order
+
+/*
+  Where the time of the running or last update went, in microseconds
+  Only counted when the library is built with UPDATE_STATS defined, all zero otherwise
+  It has to be a compiler flag (-DUPDATE_STATS, build_flags in PlatformIO,
+  compiler.cpp.extra_flags for arduino-cli), a #define in the sketch never
+  reaches Updater.cpp
+  With the pipelined writer the flash stages overlap with reading
+*/
+typedef struct {
+    uint32_t readMicros;        // reading and waiting for data in writeStream()/poll()
+    uint32_t eraseMicros;       // erasing sectors or waiting for the background erase
+    uint32_t writeMicros;       // programming sectors
+    uint32_t hashMicros;        // MD5, SHA-256 and chunk manifest
+    uint32_t verifyMicros;      // signature checks
+    uint32_t sectors;           // sectors flashed
+    uint32_t bytes;             // bytes flashed
+    uint32_t bytesCopied;       // bytes copied into sector buffers on the way,
+                                // 0 when producers read straight into them
+    uint32_t sectorMinMicros;   // per sector, erase to hash
+    uint32_t sectorMaxMicros;
+    uint32_t sectorAvgMicros;
+    uint32_t totalMicros;       // since begin(), until the update ended
+    uint32_t bytesPerSecond;    // bytes flashed over totalMicros
+} UpdateStats_t;
+
 class UpdateClass {
   public:
     typedef std::function<void(size_t, size_t)> THandlerFunction_Progress;
+    typedef std::function<void(void)> THandlerFunction_Yield;
+    typedef std::function<void(bool)> THandlerFunction_End;
 
     UpdateClass();
 
@@ -44,18 +119,158 @@ class UpdateClass {
     */
     UpdateClass& onProgress(THandlerFunction_Progress fn);
 
+    /*
+      This callback will be called after each sector is programmed, from the
+      writer task when pipelined, so the application can get a turn in between
+    */
+    UpdateClass& onYield(THandlerFunction_Yield fn);
+
+    /*
+      Paces erasing and programming from the next begin(), while the flash is busy
+      the cache is off and every task running from flash stalls
+      bytesPerSecond caps the programming rate, 0 for no limit
+      dutyCycle is the share of time (1..100%) the flash may be kept busy,
+      the background erase keeps to it as well
+      The pauses are vTaskDelay()s, so other tasks run meanwhile
+    */
+    bool setThrottle(uint32_t bytesPerSecond, uint8_t dutyCycle = 100);
+
+    /*
+      Enables the pipelined flash writer for the next begin()
+      Full sectors are handed to a dedicated task that erases and programs them
+      while write()/writeStream() keep filling the next buffer
+      buffers is the number of sector buffers (2..UPDATE_PIPELINE_MAX_BUFFERS), 0 disables it
+      core pins the writer task (tskNO_AFFINITY to let the scheduler pick)
+      Flash errors are reported by the next write() or end() through getError()
+    */
+    bool setPipeline(uint8_t buffers, BaseType_t core = tskNO_AFFINITY, UBaseType_t priority = 2);
+
+    /*
+      Moves MD5 and SHA-256 onto a task of its own for the next begin() with setPipeline()
+      Sectors are hashed there on their way to the writer task, so hashing one sector
+      overlaps programming the previous one, pin it to the other core than the writer
+      end() waits for both before the digests are checked
+      Not used for resumable updates, whose checkpoints need the digests in step with the flash
+    */
+    bool setHashTask(bool enable, BaseType_t core = tskNO_AFFINITY, UBaseType_t priority = 2);
+
+    /*
+      Enables erasing the target range in the background from the next begin()
+      With a known size 64KB blocks are erased ahead of the writer,
+      which then only waits when it catches up with the erased range
+    */
+    bool setPreErase(bool enable, BaseType_t core = tskNO_AFFINITY, UBaseType_t priority = 1);
+
+    /*
+      Enables comparing each sector with the flash before writing it from the next begin()
+      Identical sectors are neither erased nor programmed, sectors that only
+      need bits cleared are programmed without erasing first (not on encrypted
+      partitions, where the flash holds ciphertext)
+      Takes precedence over setPreErase(), the sector holding the image header is always rewritten
+    */
+    bool setCompareBeforeWrite(bool enable);
+
+    /*
+      Enables staging the whole image in PSRAM from the next begin()
+      Nothing is erased or written until end() has checked MD5, manifest and
+      signature in RAM, the image then goes to the flash in 64KB blocks
+      begin() falls back to writing as the data arrives when the PSRAM can't hold
+      the image (the partition size for compressed, U_DELTA or unknown size updates)
+      or a checkpoint was resumed; pre-erase is not used for staged updates
+      U_BUNDLE sections are never staged, each one is written as it arrives
+    */
+    bool setStaging(bool enable);
+
+    /*
+      Sets the size of the write buffer from the next begin(), a multiple of SPI_FLASH_SEC_SIZE
+      Bigger buffers are erased and programmed with fewer, larger calls
+      caps are the heap_caps_malloc() flags for it and the other buffers of the same size
+      (pipelined writer, compressed and U_DELTA input), e.g. MALLOC_CAP_INTERNAL | MALLOC_CAP_DMA
+    */
+    bool setBufferSize(size_t size, uint32_t caps = MALLOC_CAP_DEFAULT);
+
+    /*
+      Has the following updates use buffer instead of allocating one, NULL allocates again
+      size is a multiple of SPI_FLASH_SEC_SIZE, buffer is 4 byte aligned and stays
+      valid as long as it is set, it is never freed by UpdateClass
+      The pipelined writer uses it as one of its buffers and allocates the others
+    */
+    bool setBuffer(uint8_t *buffer, size_t size);
+
+    /*
+      Saves a checkpoint to NVS every sectors written sectors from the next begin()
+      so an interrupted update can continue instead of starting over, 0 disables it
+      tag identifies the image (version, ETag...), begin() only picks up a checkpoint
+      left for the same size, command, partition and tag and drops any other one
+      Compressed, U_DELTA and manifest updates are not checkpointed
+    */
+    bool setResumable(uint16_t sectors, const char *tag = NULL);
+
+    /*
+      Returns the offset in the image the data has to continue from,
+      0 unless begin() restored a checkpoint
+      Call it right after begin() and skip that many bytes of the image,
+      e.g. with an HTTP Range request
+      abort() and stream timeouts keep the checkpoint, end() clears it
+    */
+    size_t resume(){ return _resumeOffset; }
+
     /*
       Call this to check the space needed for the update
       Will return false if there is not enough space
+      With U_DELTA the data written is a DeltaPatch against the running app,
+      size is the size of the patch and the rebuilt app goes to the next OTA partition
+      Data that starts with a HeatshrinkDecoder header is decompressed on the fly,
+      for any command, size is then the compressed size
+      Data that starts with a ChunkManifest block has every chunk checked against
+      the manifest as soon as it is written, the first mismatch aborts with
+      UPDATE_ERROR_CHUNK_HASH; size includes the CHUNK_MANIFEST_SIZE bytes of the manifest
+      With signingKey() set the manifest has to be signed and then also stands in
+      for setSignature(), which remains optional
+      U_BUNDLE writes several partitions from one stream of known size, see UPDATE_BUNDLE_MAGIC
     */
     bool begin(size_t size=UPDATE_SIZE_UNKNOWN, int command = U_FLASH, int ledPin = -1, uint8_t ledOn = LOW, const char *label = NULL);
 
     /*
       Writes a buffer to the flash and increments the address
+      Whole sectors of a 4 byte aligned buffer that continue the image at a sector
+      boundary are written straight from it, without going through the write buffer
       Returns the amount written
     */
     size_t write(uint8_t *data, size_t len);
 
+    /*
+      Lends the free part of the sector buffer so a producer can read straight into it
+      capacity is set to the number of bytes that may be stored there
+      Returns NULL (capacity 0) if no update is running
+      The pointer is only valid until the next commit(), call it again each time
+    */
+    uint8_t* getWriteBuffer(size_t &capacity);
+
+    /*
+      Accounts for len bytes stored through getWriteBuffer()
+      and writes the sector to the flash once it is full
+      Returns the amount committed
+    */
+    size_t commit(size_t len);
+
+    /*
+      Writes one sector of the image at offset, for data that arrives out of order
+      like parallel range downloads, and can't be mixed with the other write calls
+      offset must be a multiple of SPI_FLASH_SEC_SIZE and len a full sector,
+      only the last sector of the image may be shorter
+      Needs the size given to begin(), compressed and U_DELTA input isn't supported
+      Safe to call from several tasks, sectors already written are ignored
+      With setPreErase() a sector far ahead waits until the erase got there
+      MD5 and SHA-256 are computed in image order as the sectors come in, up to
+      UPDATE_REORDER_SECTORS beyond the next missing one wait in RAM for it
+      (4KB each). A sector that comes further ahead is read back from the flash
+      once hashing gets there, which costs a sector read and with setPipeline()
+      a wait for the writer to catch up, so keep parallel ranges close together
+      Returns false if the update was aborted
+    */
+    bool writeAt(uint32_t offset, const uint8_t *data, size_t len);
+
     /*
       Writes the remaining bytes from the Stream to the flash
       Uses readBytes() and sets UPDATE_ERROR_STREAM on timeout
@@ -65,6 +280,47 @@ class UpdateClass {
     */
     size_t writeStream(Stream &data);
 
+    /*
+      Same as writeStream(Stream&) for network clients
+      Reads whatever is available in one go straight into the sector buffer
+      and retries every tick while waiting, instead of byte-wise timed reads
+      Sets UPDATE_ERROR_STREAM once the client disconnects or has been idle for 30 seconds
+    */
+    size_t writeStream(Client &data);
+
+    /*
+      Writes the remaining bytes from a file, e.g. on SD or SD_MMC
+      Reads straight into the sector buffer, a whole buffer at a time, so
+      setBufferSize() sets the read size and setPipeline() overlaps the reads
+      with programming the previous buffer
+      Sets UPDATE_ERROR_STREAM if the file ends early
+      Returns the bytes written
+    */
+    size_t writeFile(File &file);
+
+    /*
+      Installs the image in the file at path: begin() with the file size,
+      writeFile() and end()
+      Returns false if the file can't be opened or the update fails, see getError()
+    */
+    bool updateFromFS(fs::FS &fs, const char *path, int command = U_FLASH, int ledPin = -1, uint8_t ledOn = LOW);
+
+    /*
+      Advances the update by what the Stream has available without waiting for more
+      Stops after maxBytes or once budgetMicros have passed, whichever comes first
+      The budget is checked between reads, a full sector is written when it completes,
+      use setPipeline() to keep that short
+      Returns UPDATE_POLL_PENDING, UPDATE_POLL_DONE or UPDATE_POLL_ERROR
+      Meant to be called from loop() until it stops returning UPDATE_POLL_PENDING
+    */
+    int poll(Stream &data, uint32_t budgetMicros = 10000, size_t maxBytes = 4096);
+
+    /*
+      Same as poll(Stream&) with bulk reads from a network client
+      Fails with UPDATE_ERROR_STREAM once the client has disconnected and nothing is left to read
+    */
+    int poll(Client &data, uint32_t budgetMicros = 10000, size_t maxBytes = 4096);
+
     /*
       If all bytes are written
       this call will write the config to eboot
@@ -77,6 +333,16 @@ class UpdateClass {
     */
     bool end(bool evenIfRemaining = false);
 
+    /*
+      Runs end() on a task of its own and returns at once, so the caller can go on
+      while the last sectors are flushed, the image is verified and activated
+      fn is called from that task with what end() returned, getError() tells why it failed
+      Meanwhile isEnding() is true and the write calls, end() and abort() are refused
+      Returns false if there is nothing to end or the task can't be created, nothing was done then
+    */
+    bool endAsync(THandlerFunction_End fn, bool evenIfRemaining = false, BaseType_t core = tskNO_AFFINITY, UBaseType_t priority = 1);
+    bool isEnding(){ return _ending; }
+
     /*
       Aborts the running update
     */
@@ -97,18 +363,24 @@ class UpdateClass {
     /*
       returns the MD5 String of the successfully ended firmware
     */
-    String md5String(void){ return _md5.toString(); }
+    String md5String(void);
 
     /*
       populated the result with the md5 bytes of the successfully ended firmware
     */
-    void md5(uint8_t * result){ return _md5.getBytes(result); }
+    void md5(uint8_t * result){ memcpy(result, _md5Digest, ESP_ROM_MD5_DIGEST_LEN); }
     
     /*
-      sets the expected signature for the firmware (hexString) - CQ function
+      sets the expected signature for the firmware (hexString or base64) - CQ function
+      Returns false if it can't be decoded or is longer than UPDATE_SIGNATURE_MAX_SIZE bytes
     */
     bool setSignature(const char* expected_signature);
 
+    /*
+      sets the expected signature for the firmware (raw bytes)
+    */
+    bool setSignature(const uint8_t* signature, size_t len);
+
     //Helpers
     uint8_t getError(){ return _error; }
     void clearError(){ _error = UPDATE_ERROR_OK; }
@@ -118,16 +390,32 @@ class UpdateClass {
     size_t size(){ return _size; }
     size_t progress(){ return _progress; }
     size_t remaining(){ return _size - _progress; }
+    size_t sectorsSkipped(){ return _sectorsSkipped; }
+    size_t erasesSkipped(){ return _erasesSkipped; }
+    /*
+      Timings of the running or last update, see UpdateStats_t
+      All zero unless built with -DUPDATE_STATS
+    */
+    UpdateStats_t getStats();
 
     /* CQ added code */
     const char* pubKey_toParse = NULL;
-    bool signingKey(const char* pubkey) {
-      pubKey_toParse = pubkey;
-      if (pubKey_toParse == NULL) {
-        return false;
-      }
-      return true;
-    }
+    /*
+      Sets the public key every following update has to be signed with (PEM)
+      The key is parsed once here and kept for all updates, NULL removes it
+      Returns false if it can't be parsed, end() then fails with UPDATE_ERROR_PARSE_PUBLIC_KEY
+      Building with UPDATE_SIGNING_KEY uses the DER key the sketch provides as
+      extern const uint8_t update_signing_key[] and const size_t update_signing_key_len
+      by default, it is parsed by the first end() that needs it
+      UPDATE_SIGNING_KEY has to be a compiler flag (-DUPDATE_SIGNING_KEY in
+      build_flags or compiler.cpp.extra_flags), a #define in the sketch never
+      reaches Updater.cpp and updates then go through unsigned
+    */
+    bool signingKey(const char* pubkey);
+    /*
+      Same for a DER encoded key
+    */
+    bool signingKey(const uint8_t* der, size_t len);
 
     /*
       Template to write from objects that expose
@@ -138,7 +426,7 @@ class UpdateClass {
     template<typename T>
     size_t write(T &data){
       size_t written = 0;
-      if (hasError() || !isRunning())
+      if (hasError() || !isRunning() || _ending)
         return 0;
 
       size_t available = data.available();
@@ -146,8 +434,8 @@ class UpdateClass {
         if(_bufferLen + available > remaining()){
           available = remaining() - _bufferLen;
         }
-        if(_bufferLen + available > 4096) {
-          size_t toBuff = 4096 - _bufferLen;
+        if(_bufferLen + available > _bufferSize) {
+          size_t toBuff = _bufferSize - _bufferLen;
           data.read(_buffer + _bufferLen, toBuff);
           _bufferLen += toBuff;
           if(!_writeBuffer())
@@ -179,36 +467,208 @@ class UpdateClass {
     */
     bool rollBack();
 
+    /*
+      true if the running app was just installed and the bootloader waits for it to be confirmed
+      with markValid(), any reset before that boots the previous app again
+      needs CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE, the state is read once and cached
+    */
+    bool isPendingVerify();
+    /*
+      confirm the running app, this cancels the rollback and any validation deadline
+    */
+    bool markValid();
+    /*
+      mark the running app as invalid and reboot into the previous one
+      only returns (false) if there is no app to roll back to
+    */
+    bool markInvalid();
+    /*
+      roll back with markInvalid() unless markValid() is called within ms milliseconds
+      call it early in setup(), before the health checks that may hang
+      returns false if the running app is not pending verification
+    */
+    bool setValidationDeadline(uint32_t ms);
+
   private:
     void _reset();
     void _abort(uint8_t err);
     bool _writeBuffer();
+    bool _end(bool evenIfRemaining);
+    static void _endTask(void *arg);
+    size_t _directLen(const uint8_t *data, size_t len);
+    size_t _writeLen(uint8_t *data, size_t len);
+    void _throttle(uint32_t busyMicros, size_t len, uint32_t &debt);
+    int _poll(Stream &data, Client *client, uint32_t budgetMicros, size_t maxBytes);
+    uint8_t _commitSector(uint8_t *&data, uint32_t offset, size_t len);
+    uint8_t _flashSector(uint8_t *data, uint32_t offset, size_t len, size_t skip);
+    bool _startDecompress();
+    bool _decoded(const uint8_t *data, size_t len);
+    bool _emit(const uint8_t *data, size_t len);
+    uint8_t _flushOutput();
+    bool _sectorMatches(const uint8_t *data, size_t len, bool &needsErase);
+    bool _writeAt(uint32_t offset, const uint8_t *data, size_t len);
+    bool _hashWritten();
+    bool _stageStart(size_t size);
+    uint8_t* _allocBuffer();
+    void _freeBuffer(uint8_t *buffer);
+    bool _stageFlush();
+    bool _sha256Add(const uint8_t *data, size_t len);
+    bool _sha256Finish(uint8_t *result);
+    void _sha256Restore(const uint32_t *total, const uint32_t *state, const uint8_t *buffer);
     bool _verifyHeader(uint8_t data);
     bool _verifyEnd();
     bool _enablePartition(const esp_partition_t* partition);
+    void _resumeLoad();
+    void _resumeSave(uint32_t offset);
+    void _resumeClear();
     bool _signatureValid(); // CQ
+    bool _parseSigningKey(const uint8_t *key, size_t len);
+    bool _signingKeyReady();
+    bool _bundleStart();
+    bool _bundleWrite();
+    bool _bundleSectionStart();
+    bool _bundleSectionEnd();
+    bool _bundleFinished();
+    void _statsSector(uint32_t elapsed, size_t len);
 
+    // pipelined writer
+    bool _pipelineStart();
+    void _pipelineStop();
+    uint8_t _pipelineSubmit(uint8_t *&data, uint32_t offset, size_t len, size_t skip);
+    bool _pipelineDrain();
+    void _pipelineReport();
+    void _pipelineLoop();
+    static void _pipelineTask(void *arg);
+    void _hashLoop();
+    static void _hashTask(void *arg);
+
+    // background erase
+    bool _eraseStart();
+    void _eraseStop();
+    bool _eraseWait(uint32_t offset);
+    void _eraseLoop();
+    static void _eraseTask(void *arg);
 
     uint8_t _error;
     uint8_t *_buffer;
-    uint8_t *_skipBuffer;
+    uint32_t _skipBuffer[ENCRYPTED_BLOCK_SIZE / sizeof(uint32_t)];
     size_t _bufferLen;
+    size_t _bufferSize;
+    uint32_t _bufferCaps;
+    uint8_t *_userBuffer;       // given to setBuffer(), never freed here
     size_t _size;
     THandlerFunction_Progress _progress_callback;
+    THandlerFunction_Yield _yield_callback;
     uint32_t _progress;
     uint32_t _paroffset;
     uint32_t _command;
     const esp_partition_t* _partition;
+    bool _encrypted;            // _partition is written through flash encryption
 
     String _target_md5;
-    MD5Builder _md5;
+    md5_context_t _md5;         // plain ROM state, so a checkpoint can carry it
+    uint8_t _md5Digest[ESP_ROM_MD5_DIGEST_LEN];
 
     // CQ
-    String _target_signature;
-    int _target_signature_lenght;
+    uint8_t _target_signature[UPDATE_SIGNATURE_MAX_SIZE];
+    size_t _target_signature_len;
+    mbedtls_pk_context _signingKey;
+    bool _signingKeySet;        // updates have to be signed
+    bool _signingKeyParsed;
+    bool _signingKeyEmbedded;   // UPDATE_SIGNING_KEY not parsed yet
+    mbedtls_sha256_context _sha256;
+    uint8_t _sha256Tail[32];    // last bytes, possibly the digest appended to the image
+    size_t _sha256TailLen;
+    bool _hashAppended;
 
     int _ledPin;
     uint8_t _ledOn;
+
+    // rebuilt image when the input is transformed
+    DeltaPatch _patch;
+    HeatshrinkDecoder _inflate;
+    bool _transform;
+    uint8_t *_outBuffer;
+    size_t _outLen;
+    uint32_t _outOffset;
+    uint8_t _outError;
+
+    ChunkManifest _manifest;
+    uint32_t _imageStart;       // bytes of the input in front of the image
+
+    // U_BUNDLE sections are each written through _section
+    UpdateClass *_section;
+    const esp_partition_t *_bundleApp;
+    mbedtls_sha256_context _sectionSha256;
+    uint8_t _bundleHeader[UPDATE_BUNDLE_SECTION_SIZE];
+    size_t _bundleHeaderLen;
+    int16_t _bundleSections;    // sections still to come, -1 until the bundle header is read
+    uint32_t _bundleLeft;       // bytes of the current section still to come
+    bool _deferActivation;      // leave switching the boot partition to the bundle
+
+    volatile bool _ending;      // endAsync() task running
+    bool _endEvenIfRemaining;
+    THandlerFunction_End _endCallback;
+
+    uint8_t _pipeBuffers;
+    BaseType_t _pipeCore;
+    UBaseType_t _pipePriority;
+    uint8_t *_pipePool[UPDATE_PIPELINE_MAX_BUFFERS];
+    QueueHandle_t _pipeFull;
+    QueueHandle_t _pipeFree;
+    TaskHandle_t _pipeTask;
+    volatile uint8_t _pipeError;
+    volatile uint32_t _pipeFlushed;
+    uint32_t _pipeReported;
+
+    bool _hashTaskEnabled;
+    BaseType_t _hashCore;
+    UBaseType_t _hashPriority;
+    QueueHandle_t _hashFull;    // sectors on their way to the hash task, NULL without it
+    TaskHandle_t _hashTaskHandle;
+    volatile uint8_t _hashError;
+
+    bool _eraseAhead;
+    BaseType_t _eraseCore;
+    UBaseType_t _erasePriority;
+    SemaphoreHandle_t _eraseSignal;
+    uint32_t _eraseEnd;
+    bool _eraseBlocks;
+    volatile uint32_t _eraseFrontier;
+    volatile bool _eraseRunning;
+    volatile bool _eraseCancel;
+
+    bool _compare;
+    uint8_t *_compareBuffer;
+    size_t _sectorsSkipped;
+    size_t _erasesSkipped;
+
+    UpdateStats_t _stats;
+    uint32_t _statsStart;
+    uint32_t _statsSectorMicros;
+
+    uint32_t _throttleRate;
+    uint8_t _throttleDuty;
+    uint32_t _throttleDebt;     // pause owed to the writer, in microseconds
+
+    bool _staging;
+    uint8_t *_stage;            // PSRAM copy of the image, NULL when writing directly
+    size_t _stageSize;
+    size_t _stageLen;           // bytes of the image staged so far
+
+    SemaphoreHandle_t _rangeLock;
+    uint32_t *_sectorMap;       // sectors written by writeAt(), NULL for in order writes
+    uint8_t *_reorder;          // UPDATE_REORDER_SECTORS slots, by sector number
+    uint32_t _reorderHeld;      // bit per slot holding a sector not hashed yet
+    uint32_t _hashNext;         // writeAt() images are hashed up to here
+
+    uint16_t _resumeEvery;
+    uint8_t _resumeTag[16];     // MD5 of the tag given to setResumable()
+    uint32_t _resumeOffset;
+
+    int8_t _pendingVerify;      // cached isPendingVerify(), -1 until read
+    int8_t _canRollBack;        // cached canRollBack(), -1 until read or after begin()
+    esp_timer_handle_t _deadline;
 };
 
 extern UpdateClass Update;
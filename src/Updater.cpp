@@ -3,11 +3,25 @@
 #include "esp_spi_flash.h"
 #include "esp_ota_ops.h"
 #include "esp_image_format.h"
+#include "esp_heap_caps.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "nvs.h"
+#include <new>
 
 #include "mbedtls/sha256.h"
 #include "mbedtls/base64.h"
 #include "mbedtls/x509_csr.h"
 
+#ifdef UPDATE_SIGNING_KEY
+//DER key compiled into the sketch
+extern const uint8_t update_signing_key[];
+extern const size_t update_signing_key_len;
+#define UPDATE_SIGNING_KEY_EMBEDDED true
+#else
+#define UPDATE_SIGNING_KEY_EMBEDDED false
+#endif
+
 static const char * _err2str(uint8_t _error){
     if(_error == UPDATE_ERROR_OK){
         return ("No Error");
@@ -44,10 +58,69 @@ static const char * _err2str(uint8_t _error){
         return ("Signature Not Valid");
     } else if(_error == UPDATE_ERROR_SIGNATURE_VERIFICATION){
         return ("Firmware Signature Verification Failed");
+    } else if(_error == UPDATE_ERROR_PATCH){
+        return ("Delta Patch Invalid");
+    } else if(_error == UPDATE_ERROR_DECOMPRESS){
+        return ("Decompression Failed");
+    } else if(_error == UPDATE_ERROR_MANIFEST){
+        return ("Chunk Manifest Invalid");
+    } else if(_error == UPDATE_ERROR_CHUNK_HASH){
+        return ("Chunk Hash Mismatch");
+    } else if(_error == UPDATE_ERROR_BUNDLE){
+        return ("Bundle Invalid");
+    } else if(_error == UPDATE_ERROR_SECTION_HASH){
+        return ("Bundle Section Hash Mismatch");
     }
     return ("UNKNOWN");
 }
 
+typedef struct {
+    uint8_t *data;      // NULL asks the hash and writer tasks to stop
+    uint32_t offset;
+    size_t len;
+    size_t skip;
+} update_sector_t;
+
+#define UPDATE_ERASE_BLOCK_SIZE 0x10000
+
+//same limit as the 300 x 100ms retries of writeStream(Stream&)
+#define UPDATE_STREAM_TIMEOUT_MS 30000
+
+#define UPDATE_RESUME_NAMESPACE "update"
+#define UPDATE_RESUME_KEY       "resume"
+#define UPDATE_RESUME_VERSION   3
+
+#ifdef UPDATE_STATS
+#define UPDATE_STATS_START(t)       uint32_t t = micros()
+#define UPDATE_STATS_ADD(field, t)  _stats.field += micros() - t
+#define UPDATE_STATS_COPY(len)      _stats.bytesCopied += len
+#else
+#define UPDATE_STATS_START(t)
+#define UPDATE_STATS_ADD(field, t)
+#define UPDATE_STATS_COPY(len)
+#endif
+
+//everything needed to carry on after offset, stored as one blob so it is
+//either fully written or not at all
+typedef struct {
+    uint32_t version;
+    uint32_t address;   // of the target partition
+    uint32_t size;
+    uint32_t command;
+    uint32_t offset;
+    uint8_t tag[16];
+    uint8_t skip[ENCRYPTED_BLOCK_SIZE];
+    uint8_t hashAppended;
+    uint8_t tailLen;
+    uint8_t tail[32];
+    uint32_t md5Buf[4];         // md5_context_t, field by field
+    uint32_t md5Bits[2];
+    uint8_t md5In[64];
+    uint32_t shaTotal[2];       // the fields every mbedtls_sha256_context port has
+    uint32_t shaState[8];
+    uint8_t shaBuffer[64];
+} update_resume_t;
+
 static bool _partitionIsBootable(const esp_partition_t* partition){
     uint8_t buf[ENCRYPTED_BLOCK_SIZE];
     if(!partition){
@@ -64,6 +137,7 @@ static bool _partitionIsBootable(const esp_partition_t* partition){
 }
 
 bool UpdateClass::_enablePartition(const esp_partition_t* partition){
+    //one encrypted block, the only write to it during the update
     if(!partition){
         return false;
     }
@@ -74,13 +148,88 @@ UpdateClass::UpdateClass()
 : _error(0)
 , _buffer(0)
 , _bufferLen(0)
+, _bufferSize(SPI_FLASH_SEC_SIZE)
+, _bufferCaps(MALLOC_CAP_DEFAULT)
+, _userBuffer(NULL)
 , _size(0)
 , _progress_callback(NULL)
+, _yield_callback(NULL)
 , _progress(0)
 , _paroffset(0)
 , _command(U_FLASH)
 , _partition(NULL)
+, _encrypted(false)
+, _target_signature_len(0)
+, _signingKeySet(UPDATE_SIGNING_KEY_EMBEDDED)
+, _signingKeyParsed(false)
+, _signingKeyEmbedded(UPDATE_SIGNING_KEY_EMBEDDED)
+, _transform(false)
+, _outBuffer(NULL)
+, _outLen(0)
+, _outOffset(0)
+, _outError(UPDATE_ERROR_OK)
+, _imageStart(0)
+, _section(NULL)
+, _bundleApp(NULL)
+, _bundleHeaderLen(0)
+, _bundleSections(-1)
+, _bundleLeft(0)
+, _deferActivation(false)
+, _ending(false)
+, _endEvenIfRemaining(false)
+, _endCallback(NULL)
+, _pipeBuffers(0)
+, _pipeCore(tskNO_AFFINITY)
+, _pipePriority(2)
+, _pipeFull(NULL)
+, _pipeFree(NULL)
+, _pipeTask(NULL)
+, _pipeError(UPDATE_ERROR_OK)
+, _pipeFlushed(0)
+, _pipeReported(0)
+, _hashTaskEnabled(false)
+, _hashCore(tskNO_AFFINITY)
+, _hashPriority(2)
+, _hashFull(NULL)
+, _hashTaskHandle(NULL)
+, _hashError(UPDATE_ERROR_OK)
+, _eraseAhead(false)
+, _eraseCore(tskNO_AFFINITY)
+, _erasePriority(1)
+, _eraseSignal(NULL)
+, _eraseEnd(0)
+, _eraseBlocks(false)
+, _eraseFrontier(0)
+, _eraseRunning(false)
+, _eraseCancel(false)
+, _compare(false)
+, _compareBuffer(NULL)
+, _sectorsSkipped(0)
+, _erasesSkipped(0)
+, _statsStart(0)
+, _statsSectorMicros(0)
+, _throttleRate(0)
+, _throttleDuty(100)
+, _throttleDebt(0)
+, _staging(false)
+, _stage(NULL)
+, _stageSize(0)
+, _stageLen(0)
+, _rangeLock(NULL)
+, _sectorMap(NULL)
+, _reorder(NULL)
+, _reorderHeld(0)
+, _hashNext(0)
+, _resumeEvery(0)
+, _resumeOffset(0)
+, _pendingVerify(-1)
+, _canRollBack(-1)
+, _deadline(NULL)
 {
+    mbedtls_pk_init(&_signingKey);
+    mbedtls_sha256_init(&_sha256);
+    mbedtls_sha256_init(&_sectionSha256);
+    memset(&_stats, 0, sizeof(_stats));
 }
 
 UpdateClass& UpdateClass::onProgress(THandlerFunction_Progress fn) {
@@ -88,14 +237,63 @@ UpdateClass& UpdateClass::onProgress(THandlerFunction_Progress fn) {
     return *this;
 }
 
+UpdateClass& UpdateClass::onYield(THandlerFunction_Yield fn) {
+    _yield_callback = fn;
+    return *this;
+}
+
 void UpdateClass::_reset() {
-    if (_buffer)
-        delete[] _buffer;
+#ifdef UPDATE_STATS
+    if (_size) {
+        _stats.totalMicros = micros() - _statsStart;
+    }
+#endif
+    _eraseStop();
+    _patch.end();
+    _inflate.end();
+    _manifest.end();
+    _imageStart = 0;
+    if (_section && _section->isRunning()) {
+        _section->abort();
+    }
+    _bundleApp = NULL;
+    mbedtls_sha256_free(&_sectionSha256);
+    bool pooled = _pipeTask != NULL;
+    if (pooled) {
+        _pipelineStop();
+    }
+    //the sector buffer is the output one when the input is transformed
+    if (_transform) {
+        _freeBuffer(_buffer);
+        if (!pooled)
+            _freeBuffer(_outBuffer);
+    } else if (!pooled) {
+        _freeBuffer(_buffer);
+    }
     _buffer = 0;
+    _outBuffer = NULL;
+    _outLen = 0;
+    _outOffset = 0;
+    _transform = false;
+    free(_compareBuffer);
+    _compareBuffer = NULL;
+    free(_sectorMap);
+    _sectorMap = NULL;
+    free(_reorder);
+    _reorder = NULL;
+    _reorderHeld = 0;
+    _hashNext = 0;
+    heap_caps_free(_stage);
+    _stage = NULL;
+    _stageSize = 0;
+    _stageLen = 0;
     _bufferLen = 0;
     _progress = 0;
     _size = 0;
     _command = U_FLASH;
+    _resumeOffset = 0;
+    //also releases the SHA engine on chips that lock it per context
+    mbedtls_sha256_free(&_sha256);
 
     if(_ledPin != -1) {
       digitalWrite(_ledPin, !_ledOn); // off
@@ -106,16 +304,71 @@ bool UpdateClass::canRollBack(){
     if(_buffer){ //Update is running
         return false;
     }
-    const esp_partition_t* partition = esp_ota_get_next_update_partition(NULL);
-    return _partitionIsBootable(partition);
+    if(_canRollBack < 0){
+        _canRollBack = _partitionIsBootable(esp_ota_get_next_update_partition(NULL));
+    }
+    return _canRollBack;
 }
 
 bool UpdateClass::rollBack(){
-    if(_buffer){ //Update is running
+    if(!canRollBack()){
+        return false;
+    }
+    return !esp_ota_set_boot_partition(esp_ota_get_next_update_partition(NULL));
+}
+
+bool UpdateClass::isPendingVerify(){
+    if(_pendingVerify < 0){
+        esp_ota_img_states_t state;
+        _pendingVerify = !esp_ota_get_state_partition(esp_ota_get_running_partition(), &state)
+            && state == ESP_OTA_IMG_PENDING_VERIFY;
+    }
+    return _pendingVerify;
+}
+
+bool UpdateClass::markValid(){
+    if(esp_ota_mark_app_valid_cancel_rollback()){
+        log_e("could not mark the app as valid");
+        return false;
+    }
+    if(_deadline){
+        esp_timer_stop(_deadline);
+        esp_timer_delete(_deadline);
+        _deadline = NULL;
+    }
+    _pendingVerify = 0;
+    return true;
+}
+
+bool UpdateClass::markInvalid(){
+    esp_ota_mark_app_invalid_rollback_and_reboot();
+    log_e("no app to roll back to");
+    return false;
+}
+
+static void _validationExpired(void *arg){
+    (void)arg;
+    log_e("app not confirmed in time, rolling back");
+    esp_ota_mark_app_invalid_rollback_and_reboot();
+    //still pending verify, the bootloader rolls back on the next boot
+    ESP.restart();
+}
+
+bool UpdateClass::setValidationDeadline(uint32_t ms){
+    if(!isPendingVerify()){
         return false;
     }
-    const esp_partition_t* partition = esp_ota_get_next_update_partition(NULL);
-    return _partitionIsBootable(partition) && !esp_ota_set_boot_partition(partition);
+    if(!_deadline){
+        esp_timer_create_args_t args = {};
+        args.callback = _validationExpired;
+        args.name = "ota_deadline";
+        if(esp_timer_create(&args, &_deadline)){
+            _deadline = NULL;
+            return false;
+        }
+    }
+    esp_timer_stop(_deadline);
+    return !esp_timer_start_once(_deadline, (uint64_t)ms * 1000);
 }
 
 bool UpdateClass::begin(size_t size, int command, int ledPin, uint8_t ledOn, const char *label) {
@@ -129,15 +382,21 @@ bool UpdateClass::begin(size_t size, int command, int ledPin, uint8_t ledOn, con
 
     _reset();
     _error = 0;
+    _canRollBack = -1;
+#ifdef UPDATE_STATS
+    memset(&_stats, 0, sizeof(_stats));
+    _statsStart = micros();
+    _statsSectorMicros = 0;
+#endif
     _target_md5 = emptyString;
-    _md5 = MD5Builder();
+    memset(_md5Digest, 0, sizeof(_md5Digest));
 
     if(size == 0) {
         _error = UPDATE_ERROR_SIZE;
         return false;
     }
 
-    if (command == U_FLASH) {
+    if (command == U_FLASH || command == U_DELTA) {
         _partition = esp_ota_get_next_update_partition(NULL);
         if(!_partition){
             _error = UPDATE_ERROR_NO_PARTITION;
@@ -157,29 +416,96 @@ bool UpdateClass::begin(size_t size, int command, int ledPin, uint8_t ledOn, con
             }
         }
     }
+    else if (command == U_BUNDLE) {
+        //the sections pick their partitions
+        if(size == UPDATE_SIZE_UNKNOWN){
+            _error = UPDATE_ERROR_SIZE;
+            log_e("bundle size unknown");
+            return false;
+        }
+        _partition = NULL;
+    }
     else {
         _error = UPDATE_ERROR_BAD_ARGUMENT;
         log_e("bad command %u", command);
         return false;
     }
 
+    _eraseBlocks = size != UPDATE_SIZE_UNKNOWN;
     if(size == UPDATE_SIZE_UNKNOWN){
         size = _partition->size;
-    } else if(size > _partition->size){
+    } else if(_partition && size > _partition->size){
         _error = UPDATE_ERROR_SIZE;
         log_e("too large %u > %u", size, _partition->size);
         return false;
     }
 
     //initialize
-    _buffer = (uint8_t*)malloc(SPI_FLASH_SEC_SIZE);
-    if(!_buffer){
-        log_e("malloc failed");
-        return false;
+    if(!_rangeLock){
+        _rangeLock = xSemaphoreCreateMutex();
+        if(!_rangeLock){
+            log_e("mutex create failed");
+            return false;
+        }
+    }
+    if (_pipeBuffers && command != U_BUNDLE) {
+        if(!_pipelineStart()){
+            return false;
+        }
+        _buffer = _pipePool[0];
+    } else {
+        _buffer = _userBuffer ? _userBuffer : _allocBuffer();
+        if(!_buffer){
+            log_e("malloc failed");
+            return false;
+        }
+    }
+    if (command == U_DELTA) {
+        //patch bytes get their own buffer, the sector buffer takes the rebuilt app
+        _transform = true;
+        _outBuffer = _buffer;
+        _buffer = _allocBuffer();
+        if(!_buffer || !_patch.begin(esp_ota_get_running_partition(), [this](const uint8_t *data, size_t len){ return _emit(data, len); })){
+            log_e("delta init failed");
+            _reset();
+            return false;
+        }
+        command = U_FLASH;
     }
     _size = size;
     _command = command;
-    _md5.begin();
+    _encrypted = _partition && _partition->encrypted;
+    esp_rom_md5_init(&_md5);
+    mbedtls_sha256_init(&_sha256);
+    mbedtls_sha256_starts_ret(&_sha256, 0);
+    _sha256TailLen = 0;
+    _hashAppended = false;
+    _sectorsSkipped = 0;
+    _erasesSkipped = 0;
+    _throttleDebt = 0;
+    if(command == U_BUNDLE){
+        return _bundleStart();
+    }
+    _resumeLoad();
+    //a resumed update already has its start on the flash, and the hash of an
+    //encrypted data partition covers ciphertext of sectors not erased yet
+    if(_staging && !_resumeOffset && !(_encrypted && command == U_SPIFFS)){
+        _stageStart(_transform ? _partition->size : _size);
+    }
+    if(_compare && !_stage){
+        _compareBuffer = (uint8_t*)malloc(_bufferSize);
+        if(!_compareBuffer){
+            log_e("malloc failed");
+            _reset();
+            return false;
+        }
+        if(_eraseAhead){
+            log_w("pre-erase ignored when comparing before write");
+        }
+    } else if(_eraseAhead && !_stage && !_eraseStart()){
+        _reset();
+        return false;
+    }
     return true;
 }
 
@@ -189,227 +515,1609 @@ void UpdateClass::_abort(uint8_t err){
 }
 
 void UpdateClass::abort(){
+    if(_ending){
+        log_w("ending");
+        return;
+    }
     _abort(UPDATE_ERROR_ABORT);
 }
 
 bool UpdateClass::_writeBuffer(){
-    //first bytes of new firmware
-    uint8_t skip = 0;
-    if(!_progress && _command == U_FLASH){
-        //check magic
-        if(_buffer[0] != ESP_IMAGE_HEADER_MAGIC){
-            _abort(UPDATE_ERROR_MAGIC_BYTE);
+    if (!_progress && _progress_callback) {
+        _progress_callback(0, _size);
+    }
+    if(_command == U_BUNDLE){
+        if(!_bundleWrite()){
             return false;
         }
-
-        //Stash the first 16 bytes of data and set the offset so they are
-        //not written at this point so that partially written firmware
-        //will not be bootable
-        skip = ENCRYPTED_BLOCK_SIZE;
-        _skipBuffer = (uint8_t*)malloc(skip);
-        if(!_skipBuffer){
-            log_e("malloc failed");
-        return false;
+        _progress += _bufferLen;
+        _bufferLen = 0;
+        if (_progress_callback) {
+            _progress_callback(_progress, _size);
         }
-        memcpy(_skipBuffer, _buffer, skip);
+        return true;
     }
-    if (!_progress && _progress_callback) {
-        _progress_callback(0, _size);
+    if(!_progress && ChunkManifest::isManifest(_buffer, _bufferLen)){
+        if(_signingKeySet && !_signingKeyReady()){
+            _abort(UPDATE_ERROR_PARSE_PUBLIC_KEY);
+            return false;
+        }
+        UPDATE_STATS_START(verifyStart);
+        if(_bufferLen < CHUNK_MANIFEST_SIZE || !_manifest.begin(_buffer, CHUNK_MANIFEST_SIZE, _signingKeySet ? &_signingKey : NULL)){
+            log_e("bad chunk manifest");
+            _abort(UPDATE_ERROR_MANIFEST);
+            return false;
+        }
+        UPDATE_STATS_ADD(verifyMicros, verifyStart);
+        //the image follows the manifest block, sector aligned again
+        _imageStart = _progress = CHUNK_MANIFEST_SIZE;
+        _bufferLen -= CHUNK_MANIFEST_SIZE;
+        if (_progress_callback) {
+            _progress_callback(_progress, _size);
+        }
+        if(!_bufferLen){
+            return true;
+        }
+        //a buffer larger than the manifest already holds the start of the image
+        memmove(_buffer, _buffer + CHUNK_MANIFEST_SIZE, _bufferLen);
     }
-    if(!ESP.partitionEraseRange(_partition, _progress, SPI_FLASH_SEC_SIZE)){
-        _abort(UPDATE_ERROR_ERASE);
+    if(_progress == _imageStart && HeatshrinkDecoder::isCompressed(_buffer, _bufferLen) && !_startDecompress()){
+        _abort(UPDATE_ERROR_DECOMPRESS);
         return false;
     }
-    if (!ESP.partitionWrite(_partition, _progress + skip, (uint32_t*)_buffer + skip/sizeof(uint32_t), _bufferLen - skip)) {
-        _abort(UPDATE_ERROR_WRITE);
-        return false;
+    if(_transform){
+        //rebuilt sectors reach the flash through _emit()
+        _outError = UPDATE_ERROR_OK;
+        bool ok = _inflate.isRunning() ? _inflate.write(_buffer, _bufferLen) : _patch.write(_buffer, _bufferLen);
+        if(!ok){
+            if(_outError == UPDATE_ERROR_OK){
+                _outError = _inflate.isRunning() ? UPDATE_ERROR_DECOMPRESS : UPDATE_ERROR_PATCH;
+            }
+            _abort(_outError);
+            return false;
+        }
+        _progress += _bufferLen;
+        _bufferLen = 0;
+        if (_progress_callback) {
+            _progress_callback(_progress, _size);
+        }
+        return true;
     }
-    //restore magic or md5 will fail
-    if(!_progress && _command == U_FLASH){
-        _buffer[0] = ESP_IMAGE_HEADER_MAGIC;
+    uint8_t err = _commitSector(_buffer, _progress - _imageStart, _bufferLen);
+    if(err != UPDATE_ERROR_OK){
+        _abort(err);
+        return false;
     }
-    _md5.add(_buffer, _bufferLen);
     _progress += _bufferLen;
     _bufferLen = 0;
-    if (_progress_callback) {
+    if (_pipeTask) {
+        _pipelineReport();
+    } else if (_progress_callback) {
         _progress_callback(_progress, _size);
     }
     return true;
 }
 
-bool UpdateClass::_verifyHeader(uint8_t data) {
-    if(_command == U_FLASH) {
-        if(data != ESP_IMAGE_HEADER_MAGIC) {
-            _abort(UPDATE_ERROR_MAGIC_BYTE);
-            return false;
+uint8_t UpdateClass::_commitSector(uint8_t *&data, uint32_t offset, size_t len){
+    //first bytes of new firmware
+    size_t skip = 0;
+    if(!offset && _command == U_FLASH){
+        //check magic
+        if(data[0] != ESP_IMAGE_HEADER_MAGIC){
+            return UPDATE_ERROR_MAGIC_BYTE;
         }
-        return true;
-    } else if(_command == U_SPIFFS) {
-        return true;
+
+        //Stash the first 16 bytes of data and set the offset so they are
+        //not written at this point so that partially written firmware
+        //will not be bootable
+        skip = ENCRYPTED_BLOCK_SIZE;
+        memcpy(_skipBuffer, data, skip);
+        _hashAppended = len >= sizeof(esp_image_header_t) && ((esp_image_header_t*)data)->hash_appended == 1;
     }
-    return false;
+    //checked before the sector is handed on, a bad chunk fails right here
+    if(_manifest.isRunning()){
+        UPDATE_STATS_START(hashStart);
+        if(!_manifest.add(data, len)){
+            log_e("chunk %u does not match the manifest", _manifest.chunk());
+            return UPDATE_ERROR_CHUNK_HASH;
+        }
+        UPDATE_STATS_ADD(hashMicros, hashStart);
+    }
+    if(_stage){
+        //stays in RAM until end() has checked the whole image
+        if(offset + len > _stageSize){
+            return UPDATE_ERROR_SPACE;
+        }
+        memcpy(_stage + offset, data, len);
+        UPDATE_STATS_COPY(len);
+        if(offset + len > _stageLen){
+            _stageLen = offset + len;
+        }
+        if(_sectorMap){
+            return UPDATE_ERROR_OK;
+        }
+        UPDATE_STATS_START(hashStart);
+        esp_rom_md5_update(&_md5, data, len);
+        if(!_sha256Add(data, len)){
+            return UPDATE_ERROR_GET_SHA256;
+        }
+        UPDATE_STATS_ADD(hashMicros, hashStart);
+        return UPDATE_ERROR_OK;
+    }
+    if(_pipeTask){
+        return _pipelineSubmit(data, offset, len, skip);
+    }
+    return _flashSector(data, offset, len, skip);
 }
 
-bool UpdateClass::_verifyEnd() {
-    if(_command == U_FLASH) {
-        if(!_enablePartition(_partition) || !_partitionIsBootable(_partition)) {
-            _abort(UPDATE_ERROR_READ);
+bool UpdateClass::_startDecompress(){
+    if(!_transform){
+        //the buffer just filled becomes the first output sector,
+        //compressed bytes move to a buffer of their own
+        uint8_t *input = _allocBuffer();
+        if(!input){
+            log_e("malloc failed");
             return false;
         }
-
-        if(esp_ota_set_boot_partition(_partition)){
-            _abort(UPDATE_ERROR_ACTIVATE);
-            return false;
+        memcpy(input, _buffer, _bufferLen);
+        UPDATE_STATS_COPY(_bufferLen);
+        _outBuffer = _buffer;
+        _buffer = input;
+        _transform = true;
+        //the decompressed image can take the whole partition
+        if(_stage && _stageSize < _partition->size){
+            uint8_t *stage = (uint8_t*)heap_caps_realloc(_stage, _partition->size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+            if(stage){
+                _stage = stage;
+                _stageSize = _partition->size;
+            } else {
+                log_w("no PSRAM for the decompressed image, writing directly");
+                heap_caps_free(_stage);
+                _stage = NULL;
+                _stageSize = 0;
+            }
         }
-        _reset();
-        return true;
-    } else if(_command == U_SPIFFS) {
-        _reset();
-        return true;
     }
-    return false;
+    return _inflate.begin([this](const uint8_t *data, size_t len){ return _decoded(data, len); });
 }
 
-bool UpdateClass::setMD5(const char * expected_md5){
-    if(strlen(expected_md5) != 32)
-    {
+bool UpdateClass::_decoded(const uint8_t *data, size_t len){
+    //a compressed patch still has to be applied
+    if(!_patch.isRunning()){
+        return _emit(data, len);
+    }
+    if(!_patch.write(data, len)){
+        if(_outError == UPDATE_ERROR_OK){
+            _outError = UPDATE_ERROR_PATCH;
+        }
         return false;
     }
-    _target_md5 = expected_md5;
     return true;
 }
 
-bool UpdateClass::setSignature(const char* expected_signature) {
-    _target_signature_lenght = strlen(expected_signature);
-    _target_signature = expected_signature;
+bool UpdateClass::_emit(const uint8_t *data, size_t len){
+    if(_outOffset + _outLen + len > _partition->size){
+        _outError = UPDATE_ERROR_SPACE;
+        return false;
+    }
+    while(len){
+        size_t toBuff = _bufferSize - _outLen;
+        if(toBuff > len){
+            toBuff = len;
+        }
+        memcpy(_outBuffer + _outLen, data, toBuff);
+        UPDATE_STATS_COPY(toBuff);
+        _outLen += toBuff;
+        data += toBuff;
+        len -= toBuff;
+        if(_outLen == _bufferSize){
+            _outError = _flushOutput();
+            if(_outError != UPDATE_ERROR_OK){
+                return false;
+            }
+        }
+    }
     return true;
 }
 
-void charsToBytes(char* chars, byte* byte_array, int byte_array_len) {
-    for (int i = 0; i <byte_array_len; i++) {
-        sscanf(chars + 2*i, "%02x", &byte_array[i]);
+uint8_t UpdateClass::_flushOutput(){
+    if(!_outLen){
+        return UPDATE_ERROR_OK;
+    }
+    uint8_t err = _commitSector(_outBuffer, _outOffset, _outLen);
+    if(err == UPDATE_ERROR_OK){
+        _outOffset += _outLen;
+        _outLen = 0;
     }
+    return err;
 }
 
-bool UpdateClass::_signatureValid() {
-
-    // get the sha256 of the dowloaded fw 
-    uint8_t FWsha_256[64] = { 0 };
-    int rc = _enablePartition(_partition);
-    if (rc == 0) {
-        _abort(UPDATE_ERROR_NO_PARTITION);
-        return false;
+uint8_t UpdateClass::_flashSector(uint8_t *data, uint32_t offset, size_t len, size_t skip){
+    UPDATE_STATS_START(sectorStart);
+    size_t eraseLen = (len + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1);
+    uint32_t busyMicros = 0;    //erasing and programming only, what _throttle() paces
+    bool needsErase = true;
+    bool needsWrite = true;
+    //the header sector is always erased so a partial image stays unbootable
+    if(_compareBuffer && (offset || _command != U_FLASH)){
+        if(!ESP.partitionRead(_partition, offset, (uint32_t*)_compareBuffer, len)){
+            return UPDATE_ERROR_READ;
+        }
+        needsWrite = !_sectorMatches(data, len, needsErase);
+        if(!needsWrite){
+            _sectorsSkipped++;
+        }
+        if(!needsErase){
+            _erasesSkipped++;
+        }
     }
-    esp_err_t err = esp_partition_get_sha256(_partition, FWsha_256);
-    if (err != ESP_OK) {
-        _abort(UPDATE_ERROR_GET_SHA256);
-        return false;
+    if(needsErase){
+        UPDATE_STATS_START(eraseStart);
+        //the erase task throttles its own erases, waiting for it isn't busy
+        if(_eraseEnd){
+            if(!_eraseWait(offset + eraseLen)){
+                return UPDATE_ERROR_ERASE;
+            }
+        } else {
+            uint32_t busyStart = micros();
+            if(!ESP.partitionEraseRange(_partition, offset, eraseLen)){
+                return UPDATE_ERROR_ERASE;
+            }
+            busyMicros += micros() - busyStart;
+        }
+        UPDATE_STATS_ADD(eraseMicros, eraseStart);
+    }
+    if(needsWrite){
+        UPDATE_STATS_START(writeStart);
+        uint32_t busyStart = micros();
+        if(!ESP.partitionWrite(_partition, offset + skip, (uint32_t*)data + skip/sizeof(uint32_t), _writeLen(data, len) - skip)) {
+            return UPDATE_ERROR_WRITE;
+        }
+        busyMicros += micros() - busyStart;
+        UPDATE_STATS_ADD(writeMicros, writeStart);
+    }
+    _throttle(busyMicros, needsWrite ? len : 0, _throttleDebt);
+    if(_yield_callback){
+        _yield_callback();
+    }
+    //restore magic or md5 will fail
+    if(!offset && _command == U_FLASH){
+        data[0] = ESP_IMAGE_HEADER_MAGIC;
     }
+    //writeAt() hashes in image order itself
+    if(!_sectorMap && !_hashFull){
+        UPDATE_STATS_START(hashStart);
+        esp_rom_md5_update(&_md5, data, len);
+        if(!_sha256Add(data, len)){
+            return UPDATE_ERROR_GET_SHA256;
+        }
+        UPDATE_STATS_ADD(hashMicros, hashStart);
+    }
+#ifdef UPDATE_STATS
+    _statsSector(micros() - sectorStart, len);
+#endif
+    if(_resumeEvery && !_transform && !_imageStart && !_sectorMap && !(len % SPI_FLASH_SEC_SIZE)
+    && (offset + len) / SPI_FLASH_SEC_SIZE / _resumeEvery != offset / SPI_FLASH_SEC_SIZE / _resumeEvery){
+        _resumeSave(offset + len);
+    }
+    return UPDATE_ERROR_OK;
+}
 
-    // verify the signature match the hash
-    mbedtls_pk_context key;
-    mbedtls_pk_init(&key);
-    rc = mbedtls_pk_parse_public_key(&key, (const unsigned char*)pubKey_toParse, strlen(pubKey_toParse) + 1);
-    if (rc != 0) {
-        _abort(UPDATE_ERROR_SIGNATURE_NOT_VALID);
-        return false;
+bool UpdateClass::_sectorMatches(const uint8_t *data, size_t len, bool &needsErase){
+    //the flash of an encrypted partition holds ciphertext, only an
+    //identical sector can be left as it is
+    if(_encrypted){
+        needsErase = memcmp(_compareBuffer, data, len) != 0;
+        return !needsErase;
+    }
+    //programming can only clear bits, so the old sector can be kept
+    //without erasing as long as it has no 0 where the new data has a 1
+    bool same = true;
+    needsErase = false;
+    size_t i = 0;
+    for(; i + sizeof(uint32_t) <= len; i += sizeof(uint32_t)){
+        uint32_t have = *(const uint32_t*)(_compareBuffer + i);
+        uint32_t want = *(const uint32_t*)(data + i);
+        same = same && have == want;
+        if((have & want) != want){
+            needsErase = true;
+            return false;
+        }
+    }
+    for(; i < len; i++){
+        same = same && _compareBuffer[i] == data[i];
+        if((_compareBuffer[i] & data[i]) != data[i]){
+            needsErase = true;
+            return false;
+        }
     }
+    return same;
+}
 
-    // convert signature String to chars
-    char new_chars_buff[_target_signature_lenght];
-    _target_signature.toCharArray(new_chars_buff, _target_signature_lenght+1);
-    // convert signature chars to byte array
-    int signatureBytesLen = strlen(new_chars_buff) / 2;
-    byte signatureBytes[signatureBytesLen];
-    charsToBytes(new_chars_buff, signatureBytes, signatureBytesLen);
+size_t UpdateClass::_writeLen(uint8_t *data, size_t len){
+    //encrypted partitions only take whole 16 byte blocks, the buffers
+    //always have room up to the next one
+    if(!_encrypted || !(len % ENCRYPTED_BLOCK_SIZE)){
+        return len;
+    }
+    size_t pad = ENCRYPTED_BLOCK_SIZE - len % ENCRYPTED_BLOCK_SIZE;
+    memset(data + len, 0xFF, pad);
+    return len + pad;
+}
 
-    rc = mbedtls_pk_verify(&key, MBEDTLS_MD_SHA256, FWsha_256, 32, signatureBytes, signatureBytesLen);
-    if (rc != 0) {
-        _abort(UPDATE_ERROR_SIGNATURE_NOT_VALID);
+bool UpdateClass::writeAt(uint32_t offset, const uint8_t *data, size_t len){
+    if(!_rangeLock){
         return false;
     }
-    return rc == 0;
+    xSemaphoreTake(_rangeLock, portMAX_DELAY);
+    bool ok = _writeAt(offset, data, len);
+    xSemaphoreGive(_rangeLock);
+    return ok;
 }
 
-bool UpdateClass::end(bool evenIfRemaining){
-    if(hasError() || _size == 0){
+bool UpdateClass::_writeAt(uint32_t offset, const uint8_t *data, size_t len){
+    if(hasError() || !isRunning() || _ending){
         return false;
     }
-
-    if(!isFinished() && !evenIfRemaining){
-        log_e("premature end: res:%u, pos:%u/%u\n", getError(), progress(), _size);
-        _abort(UPDATE_ERROR_ABORT);
+    if(offset % SPI_FLASH_SEC_SIZE || offset >= _size || len > _size - offset
+    || (len != SPI_FLASH_SEC_SIZE && offset + len != _size)){
+        log_e("bad sector 0x%x+%u", offset, len);
+        _abort(UPDATE_ERROR_BAD_ARGUMENT);
         return false;
     }
-
-    if(evenIfRemaining) {
-        if(_bufferLen > 0) {
-            _writeBuffer();
+    if(!_sectorMap){
+        //_eraseBlocks tells whether begin() got the size
+        if(_progress || _bufferLen || _transform || !_eraseBlocks || !_partition){
+            log_e("writeAt() needs a known size and no other writes");
+            _abort(UPDATE_ERROR_BAD_ARGUMENT);
+            return false;
+        }
+        size_t sectors = (_size + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE;
+        _sectorMap = (uint32_t*)calloc((sectors + 31) / 32, sizeof(uint32_t));
+        if(!_sectorMap){
+            log_e("malloc failed");
+            _abort(UPDATE_ERROR_WRITE);
+            return false;
+        }
+        //staged sectors are all in RAM anyway
+        if(!_stage){
+            _reorder = (uint8_t*)malloc(UPDATE_REORDER_SECTORS * SPI_FLASH_SEC_SIZE);
+            if(!_reorder){
+                log_w("no reorder window, sectors out of order are read back");
+            }
+        }
+        if(_progress_callback){
+            _progress_callback(0, _size);
         }
-        _size = progress();
     }
-
-    _md5.calculate();
-    if(_target_md5.length()) {
-        if(_target_md5 != _md5.toString()){
-            _abort(UPDATE_ERROR_MD5);
+    uint32_t sector = offset / SPI_FLASH_SEC_SIZE;
+    uint32_t bit = 1UL << (sector % 32);
+    if(_sectorMap[sector / 32] & bit){
+        return true;
+    }
+    memcpy(_buffer, data, len);
+    UPDATE_STATS_COPY(len);
+    uint8_t err = _commitSector(_buffer, offset, len);
+    if(err != UPDATE_ERROR_OK){
+        _abort(err);
+        return false;
+    }
+    _sectorMap[sector / 32] |= bit;
+    _progress += len;
+    if(offset == _hashNext){
+        UPDATE_STATS_START(hashStart);
+        esp_rom_md5_update(&_md5, data, len);
+        if(!_sha256Add(data, len)){
+            _abort(UPDATE_ERROR_GET_SHA256);
             return false;
         }
+        UPDATE_STATS_ADD(hashMicros, hashStart);
+        _hashNext += len;
+    } else if(_reorder && sector - _hashNext / SPI_FLASH_SEC_SIZE < UPDATE_REORDER_SECTORS){
+        uint32_t slot = sector % UPDATE_REORDER_SECTORS;
+        memcpy(_reorder + slot * SPI_FLASH_SEC_SIZE, data, len);
+        UPDATE_STATS_COPY(len);
+        _reorderHeld |= 1UL << slot;
+    }
+    if(!_hashWritten()){
+        return false;
     }
+    if(_progress_callback){
+        _progress_callback(_progress, _size);
+    }
+    return true;
+}
 
-    // CQ
-    if(pubKey_toParse != NULL) {
-        if(!_signatureValid()) {
-            _abort(UPDATE_ERROR_SIGNATURE_VERIFICATION);
-            return false;   
+bool UpdateClass::_hashWritten(){
+    //hashes on in image order as far as the sectors are in, from the reorder
+    //window or, for those that came too far ahead, from the flash with the
+    //header bytes that are still held back
+    while(_hashNext < _size){
+        uint32_t sector = _hashNext / SPI_FLASH_SEC_SIZE;
+        if(!(_sectorMap[sector / 32] & (1UL << (sector % 32)))){
+            return true;
+        }
+        size_t len = _size - _hashNext;
+        if(len > SPI_FLASH_SEC_SIZE){
+            len = SPI_FLASH_SEC_SIZE;
+        }
+        uint32_t slot = sector % UPDATE_REORDER_SECTORS;
+        uint8_t *data = _buffer;
+        if(_reorderHeld & (1UL << slot)){
+            data = _reorder + slot * SPI_FLASH_SEC_SIZE;
+            _reorderHeld &= ~(1UL << slot);
+        } else if(_stage){
+            data = _stage + _hashNext;
+        } else {
+            //the writer may still have it queued
+            if(!_pipelineDrain()){
+                return false;
+            }
+            if(!ESP.partitionRead(_partition, _hashNext, (uint32_t*)_buffer, len)){
+                _abort(UPDATE_ERROR_READ);
+                return false;
+            }
+            if(!_hashNext && _command == U_FLASH){
+                memcpy(_buffer, _skipBuffer, ENCRYPTED_BLOCK_SIZE);
+            }
         }
+        UPDATE_STATS_START(hashStart);
+        esp_rom_md5_update(&_md5, data, len);
+        if(!_sha256Add(data, len)){
+            _abort(UPDATE_ERROR_GET_SHA256);
+            return false;
+        }
+        UPDATE_STATS_ADD(hashMicros, hashStart);
+        _hashNext += len;
     }
-
-    return _verifyEnd();
+    return true;
 }
 
-size_t UpdateClass::write(uint8_t *data, size_t len) {
-    if(hasError() || !isRunning()){
-        return 0;
+bool UpdateClass::_sha256Add(const uint8_t *data, size_t len){
+    //keep the last 32 bytes out of the hash until end(), they are the
+    //digest esp_partition_get_sha256() reports for app images
+    const size_t tailSize = sizeof(_sha256Tail);
+    if(len >= tailSize){
+        if(mbedtls_sha256_update_ret(&_sha256, _sha256Tail, _sha256TailLen)
+        || mbedtls_sha256_update_ret(&_sha256, data, len - tailSize)){
+            return false;
+        }
+        memcpy(_sha256Tail, data + len - tailSize, tailSize);
+        _sha256TailLen = tailSize;
+        return true;
     }
-
-    if(len > remaining()){
-        _abort(UPDATE_ERROR_SPACE);
-        return 0;
+    if(_sha256TailLen + len > tailSize){
+        size_t out = _sha256TailLen + len - tailSize;
+        if(mbedtls_sha256_update_ret(&_sha256, _sha256Tail, out)){
+            return false;
+        }
+        memmove(_sha256Tail, _sha256Tail + out, _sha256TailLen - out);
+        _sha256TailLen -= out;
     }
+    memcpy(_sha256Tail + _sha256TailLen, data, len);
+    _sha256TailLen += len;
+    return true;
+}
 
-    size_t left = len;
-
-    while((_bufferLen + left) > SPI_FLASH_SEC_SIZE) {
-        size_t toBuff = SPI_FLASH_SEC_SIZE - _bufferLen;
-        memcpy(_buffer + _bufferLen, data + (len - left), toBuff);
-        _bufferLen += toBuff;
-        if(!_writeBuffer()){
-            return len - left;
+bool UpdateClass::_sha256Finish(uint8_t *result){
+    //same digest esp_partition_get_sha256() would read back from flash
+    if(!(_command == U_FLASH && _hashAppended && _sha256TailLen == sizeof(_sha256Tail))){
+        if(mbedtls_sha256_update_ret(&_sha256, _sha256Tail, _sha256TailLen)){
+            return false;
         }
-        left -= toBuff;
     }
-    memcpy(_buffer + _bufferLen, data + (len - left), left);
-    _bufferLen += left;
-    if(_bufferLen == remaining()){
-        if(!_writeBuffer()){
-            return len - left;
+    _sha256TailLen = 0;
+    if(_command == U_SPIFFS){
+        //data partitions are hashed over their whole size, only the
+        //part that was not written has to be read back
+        uint32_t offset = _transform ? _outOffset : _progress - _imageStart;
+        //with an unknown size the erase task may still be erasing that part
+        _eraseStop();
+        if(_stage && offset % SPI_FLASH_SEC_SIZE){
+            //the staged image is not written yet, its last sector will be erased
+            size_t pad = SPI_FLASH_SEC_SIZE - offset % SPI_FLASH_SEC_SIZE;
+            memset(_buffer, 0xFF, pad);
+            if(mbedtls_sha256_update_ret(&_sha256, _buffer, pad)){
+                return false;
+            }
+            offset += pad;
+        }
+        for(; offset < _partition->size; offset += SPI_FLASH_SEC_SIZE){
+            size_t len = _partition->size - offset;
+            if(len > SPI_FLASH_SEC_SIZE){
+                len = SPI_FLASH_SEC_SIZE;
+            }
+            if(!ESP.partitionRead(_partition, offset, (uint32_t*)_buffer, len)
+            || mbedtls_sha256_update_ret(&_sha256, _buffer, len)){
+                return false;
+            }
         }
     }
-    return len;
+    return mbedtls_sha256_finish_ret(&_sha256, result) == 0;
 }
 
-size_t UpdateClass::writeStream(Stream &data) {
-    size_t written = 0;
-    size_t toRead = 0;
-    int timeout_failures = 0;
-
-    if(hasError() || !isRunning())
-        return 0;
-
-    if(!_verifyHeader(data.peek())) {
-        _reset();
-        return 0;
+bool UpdateClass::setPipeline(uint8_t buffers, BaseType_t core, UBaseType_t priority){
+    if(_size > 0){
+        log_w("already running");
+        return false;
+    }
+    if(buffers == 1 || buffers > UPDATE_PIPELINE_MAX_BUFFERS){
+        return false;
+    }
+    _pipeBuffers = buffers;
+    _pipeCore = core;
+    _pipePriority = priority;
+    return true;
+}
+
+void UpdateClass::_pipelineTask(void *arg){
+    ((UpdateClass*)arg)->_pipelineLoop();
+}
+
+void UpdateClass::_pipelineLoop(){
+    update_sector_t sector;
+    for(;;){
+        xQueueReceive(_pipeFull, &sector, portMAX_DELAY);
+        if(!sector.data){
+            break;
+        }
+        //after a failure sectors are only recycled so the producer never blocks
+        if(_pipeError == UPDATE_ERROR_OK){
+            _pipeError = _flashSector(sector.data, sector.offset, sector.len, sector.skip);
+            if(_pipeError == UPDATE_ERROR_OK){
+                _pipeFlushed = sector.offset + sector.len;
+            }
+        }
+        xQueueSend(_pipeFree, &sector.data, portMAX_DELAY);
+    }
+    //a NULL buffer tells _pipelineStop() that the queues are no longer used
+    uint8_t *ack = NULL;
+    xQueueSend(_pipeFree, &ack, portMAX_DELAY);
+    vTaskDelete(NULL);
+}
+
+bool UpdateClass::setHashTask(bool enable, BaseType_t core, UBaseType_t priority){
+    if(_size > 0){
+        log_w("already running");
+        return false;
+    }
+    _hashTaskEnabled = enable;
+    _hashCore = core;
+    _hashPriority = priority;
+    return true;
+}
+
+void UpdateClass::_hashTask(void *arg){
+    ((UpdateClass*)arg)->_hashLoop();
+}
+
+void UpdateClass::_hashLoop(){
+    update_sector_t sector;
+    do {
+        xQueueReceive(_hashFull, &sector, portMAX_DELAY);
+        //in the order written, writeAt() hashes in image order itself
+        if(sector.data && !_sectorMap && _hashError == UPDATE_ERROR_OK){
+            UPDATE_STATS_START(hashStart);
+            esp_rom_md5_update(&_md5, sector.data, sector.len);
+            if(!_sha256Add(sector.data, sector.len)){
+                _hashError = UPDATE_ERROR_GET_SHA256;
+            }
+            UPDATE_STATS_ADD(hashMicros, hashStart);
+        }
+        //the writer hands the buffer back, or acknowledges the stop
+        xQueueSend(_pipeFull, &sector, portMAX_DELAY);
+    } while(sector.data);
+    vTaskDelete(NULL);
+}
+
+bool UpdateClass::_pipelineStart(){
+    memset(_pipePool, 0, sizeof(_pipePool));
+    for(uint8_t i = 0; i < _pipeBuffers; i++){
+        _pipePool[i] = i || !_userBuffer ? _allocBuffer() : _userBuffer;
+        if(!_pipePool[i]){
+            log_e("malloc failed");
+            break;
+        }
+    }
+    _pipeFull = xQueueCreate(_pipeBuffers, sizeof(update_sector_t));
+    _pipeFree = xQueueCreate(_pipeBuffers, sizeof(uint8_t*));
+    _pipeError = UPDATE_ERROR_OK;
+    _hashError = UPDATE_ERROR_OK;
+    _pipeFlushed = 0;
+    _pipeReported = 0;
+    if(_pipePool[_pipeBuffers - 1] && _pipeFull && _pipeFree){
+        for(uint8_t i = 1; i < _pipeBuffers; i++){
+            xQueueSend(_pipeFree, &_pipePool[i], 0);
+        }
+        if(xTaskCreatePinnedToCore(_pipelineTask, "update_writer", UPDATE_PIPELINE_STACK_SIZE, this, _pipePriority, &_pipeTask, _pipeCore) == pdPASS){
+            _buffer = _pipePool[0];
+            //the writer keeps hashing itself if the hash task can't be had
+            if(_hashTaskEnabled && !_resumeEvery){
+                _hashFull = xQueueCreate(_pipeBuffers, sizeof(update_sector_t));
+                if(_hashFull && xTaskCreatePinnedToCore(_hashTask, "update_hash", UPDATE_PIPELINE_STACK_SIZE, this, _hashPriority, &_hashTaskHandle, _hashCore) != pdPASS){
+                    log_w("hash task create failed");
+                    vQueueDelete(_hashFull);
+                    _hashFull = NULL;
+                }
+            }
+            return true;
+        }
+        log_e("writer task create failed");
+    }
+    _pipeTask = NULL;
+    if(_pipeFull) vQueueDelete(_pipeFull);
+    if(_pipeFree) vQueueDelete(_pipeFree);
+    _pipeFull = _pipeFree = NULL;
+    for(uint8_t i = 0; i < _pipeBuffers; i++){
+        _freeBuffer(_pipePool[i]);
+        _pipePool[i] = NULL;
+    }
+    return false;
+}
+
+void UpdateClass::_pipelineStop(){
+    update_sector_t stop = { NULL, 0, 0, 0 };
+    uint8_t *buf;
+    //the hash task passes the stop on to the writer
+    xQueueSend(_hashFull ? _hashFull : _pipeFull, &stop, portMAX_DELAY);
+    do {
+        xQueueReceive(_pipeFree, &buf, portMAX_DELAY);
+    } while(buf);
+    if(_hashFull){
+        vQueueDelete(_hashFull);
+        _hashFull = NULL;
+        _hashTaskHandle = NULL;
+    }
+    vQueueDelete(_pipeFull);
+    vQueueDelete(_pipeFree);
+    _pipeFull = _pipeFree = NULL;
+    _pipeTask = NULL;
+    for(uint8_t i = 0; i < _pipeBuffers; i++){
+        _freeBuffer(_pipePool[i]);
+        _pipePool[i] = NULL;
+    }
+}
+
+bool UpdateClass::setCompareBeforeWrite(bool enable){
+    if(_size > 0){
+        log_w("already running");
+        return false;
+    }
+    _compare = enable;
+    return true;
+}
+
+bool UpdateClass::setBufferSize(size_t size, uint32_t caps){
+    if(_size > 0){
+        log_w("already running");
+        return false;
+    }
+    if(!size || size % SPI_FLASH_SEC_SIZE){
+        return false;
+    }
+    _bufferSize = size;
+    _bufferCaps = caps;
+    _userBuffer = NULL;
+    return true;
+}
+
+bool UpdateClass::setBuffer(uint8_t *buffer, size_t size){
+    if(_size > 0){
+        log_w("already running");
+        return false;
+    }
+    if(!buffer){
+        return setBufferSize(SPI_FLASH_SEC_SIZE);
+    }
+    if(!size || size % SPI_FLASH_SEC_SIZE || (uintptr_t)buffer % sizeof(uint32_t)){
+        return false;
+    }
+    _bufferSize = size;
+    _userBuffer = buffer;
+    return true;
+}
+
+uint8_t* UpdateClass::_allocBuffer(){
+    return (uint8_t*)heap_caps_malloc(_bufferSize, _bufferCaps);
+}
+
+void UpdateClass::_freeBuffer(uint8_t *buffer){
+    if(buffer != _userBuffer){
+        heap_caps_free(buffer);
+    }
+}
+
+bool UpdateClass::setThrottle(uint32_t bytesPerSecond, uint8_t dutyCycle){
+    if(_size > 0){
+        log_w("already running");
+        return false;
+    }
+    if(!dutyCycle || dutyCycle > 100){
+        return false;
+    }
+    _throttleRate = bytesPerSecond;
+    _throttleDuty = dutyCycle;
+    return true;
+}
+
+void UpdateClass::_throttle(uint32_t busyMicros, size_t len, uint32_t &debt){
+    //the flash was busy for busyMicros, rest long enough to keep to the
+    //duty cycle and for len bytes to take at least their share of a second
+    uint32_t pause = 0;
+    if(_throttleDuty < 100){
+        pause = (uint64_t)busyMicros * (100 - _throttleDuty) / _throttleDuty;
+    }
+    if(_throttleRate && len){
+        uint32_t share = (uint64_t)len * 1000000 / _throttleRate;
+        if(share > busyMicros + pause){
+            pause = share - busyMicros;
+        }
+    }
+    //ticks are coarser than a sector, so short pauses add up first
+    debt += pause;
+    if(debt >= 1000 * portTICK_PERIOD_MS){
+        TickType_t ticks = debt / (1000 * portTICK_PERIOD_MS);
+        debt -= ticks * 1000 * portTICK_PERIOD_MS;
+        vTaskDelay(ticks);
+    }
+}
+
+bool UpdateClass::setStaging(bool enable){
+    if(_size > 0){
+        log_w("already running");
+        return false;
+    }
+    _staging = enable;
+    return true;
+}
+
+bool UpdateClass::_stageStart(size_t size){
+    //with room to pad the last block for _writeLen()
+    _stage = (uint8_t*)heap_caps_malloc((size + ENCRYPTED_BLOCK_SIZE - 1) & ~(ENCRYPTED_BLOCK_SIZE - 1), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if(!_stage){
+        log_w("no PSRAM for %u bytes, writing directly", size);
+        return false;
+    }
+    _stageSize = size;
+    _stageLen = 0;
+    return true;
+}
+
+bool UpdateClass::_stageFlush(){
+    //the header bytes are held back as usual, _verifyEnd() writes them last
+    size_t skip = _command == U_FLASH ? ENCRYPTED_BLOCK_SIZE : 0;
+    for(uint32_t offset = 0; offset < _stageLen; offset += UPDATE_ERASE_BLOCK_SIZE){
+        size_t len = _stageLen - offset;
+        if(len > UPDATE_ERASE_BLOCK_SIZE){
+            len = UPDATE_ERASE_BLOCK_SIZE;
+        }
+        uint32_t busyStart = micros();
+        UPDATE_STATS_START(eraseStart);
+        if(!ESP.partitionEraseRange(_partition, offset, (len + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1))){
+            _abort(UPDATE_ERROR_ERASE);
+            return false;
+        }
+        UPDATE_STATS_ADD(eraseMicros, eraseStart);
+        UPDATE_STATS_START(writeStart);
+        size_t from = offset ? 0 : skip;
+        if(!ESP.partitionWrite(_partition, offset + from, (uint32_t*)(_stage + offset + from), _writeLen(_stage + offset, len) - from)){
+            _abort(UPDATE_ERROR_WRITE);
+            return false;
+        }
+        UPDATE_STATS_ADD(writeMicros, writeStart);
+#ifdef UPDATE_STATS
+        _stats.bytes += len;
+#endif
+        _throttle(micros() - busyStart, len, _throttleDebt);
+        if(_yield_callback){
+            _yield_callback();
+        }
+    }
+    return true;
+}
+
+bool UpdateClass::setResumable(uint16_t sectors, const char *tag){
+    if(_size > 0){
+        log_w("already running");
+        return false;
+    }
+    MD5Builder md5;
+    md5.begin();
+    if(tag){
+        md5.add(tag);
+    }
+    md5.calculate();
+    md5.getBytes(_resumeTag);
+    _resumeEvery = sectors;
+    return true;
+}
+
+void UpdateClass::_sha256Restore(const uint32_t *total, const uint32_t *state, const uint8_t *buffer){
+    //a context past its first block continues from its state words on every
+    //port, a clone of one is in software mode and sets the rest of the fields
+    uint8_t block[64] = { 0 };
+    mbedtls_sha256_context running;
+    mbedtls_sha256_init(&running);
+    mbedtls_sha256_starts_ret(&running, 0);
+    mbedtls_sha256_update_ret(&running, block, sizeof(block));
+    mbedtls_sha256_free(&_sha256);
+    mbedtls_sha256_init(&_sha256);
+    mbedtls_sha256_clone(&_sha256, &running);
+    mbedtls_sha256_free(&running);
+    memcpy(_sha256.total, total, sizeof(_sha256.total));
+    memcpy(_sha256.state, state, sizeof(_sha256.state));
+    memcpy(_sha256.buffer, buffer, sizeof(_sha256.buffer));
+}
+
+void UpdateClass::_resumeLoad(){
+    update_resume_t cp;
+    size_t len = sizeof(cp);
+    nvs_handle_t nvs;
+    if(nvs_open(UPDATE_RESUME_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK){
+        return;
+    }
+    esp_err_t err = nvs_get_blob(nvs, UPDATE_RESUME_KEY, &cp, &len);
+    nvs_close(nvs);
+    if(err == ESP_ERR_NVS_NOT_FOUND){
+        return;
+    }
+    if(_resumeEvery && !_transform && err == ESP_OK && len == sizeof(cp) && cp.version == UPDATE_RESUME_VERSION
+    && cp.address == _partition->address && cp.size == _size && cp.command == _command
+    && !memcmp(cp.tag, _resumeTag, sizeof(cp.tag)) && cp.offset && cp.offset <= _size){
+        memcpy(_skipBuffer, cp.skip, ENCRYPTED_BLOCK_SIZE);
+        memcpy(_md5.buf, cp.md5Buf, sizeof(_md5.buf));
+        memcpy(_md5.bits, cp.md5Bits, sizeof(_md5.bits));
+        memcpy(_md5.in, cp.md5In, sizeof(_md5.in));
+        _sha256Restore(cp.shaTotal, cp.shaState, cp.shaBuffer);
+        memcpy(_sha256Tail, cp.tail, sizeof(_sha256Tail));
+        _sha256TailLen = cp.tailLen;
+        _hashAppended = cp.hashAppended;
+        _progress = _resumeOffset = cp.offset;
+        _pipeFlushed = _pipeReported = cp.offset;
+        log_i("resuming at 0x%x", cp.offset);
+        return;
+    }
+    //the partition is about to be rewritten, so any other checkpoint is stale
+    _resumeClear();
+}
+
+void UpdateClass::_resumeSave(uint32_t offset){
+    update_resume_t cp;
+    memset(&cp, 0, sizeof(cp));
+    cp.version = UPDATE_RESUME_VERSION;
+    cp.address = _partition->address;
+    cp.size = _size;
+    cp.command = _command;
+    cp.offset = offset;
+    memcpy(cp.tag, _resumeTag, sizeof(cp.tag));
+    memcpy(cp.skip, _skipBuffer, ENCRYPTED_BLOCK_SIZE);
+    cp.hashAppended = _hashAppended;
+    cp.tailLen = _sha256TailLen;
+    memcpy(cp.tail, _sha256Tail, sizeof(cp.tail));
+    memcpy(cp.md5Buf, _md5.buf, sizeof(cp.md5Buf));
+    memcpy(cp.md5Bits, _md5.bits, sizeof(cp.md5Bits));
+    memcpy(cp.md5In, _md5.in, sizeof(cp.md5In));
+    //a context hashing in hardware keeps its digest in the SHA engine, a clone
+    //reads it out into a software mode copy that survives a reset
+    mbedtls_sha256_context sha256;
+    mbedtls_sha256_init(&sha256);
+    mbedtls_sha256_clone(&sha256, &_sha256);
+    memcpy(cp.shaTotal, sha256.total, sizeof(cp.shaTotal));
+    memcpy(cp.shaState, sha256.state, sizeof(cp.shaState));
+    memcpy(cp.shaBuffer, sha256.buffer, sizeof(cp.shaBuffer));
+    mbedtls_sha256_free(&sha256);
+
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(UPDATE_RESUME_NAMESPACE, NVS_READWRITE, &nvs);
+    if(err == ESP_OK){
+        err = nvs_set_blob(nvs, UPDATE_RESUME_KEY, &cp, sizeof(cp));
+        if(err == ESP_OK){
+            err = nvs_commit(nvs);
+        }
+        nvs_close(nvs);
+    }
+    if(err != ESP_OK){
+        log_w("checkpoint at 0x%x not saved: %d", offset, err);
+    }
+}
+
+void UpdateClass::_resumeClear(){
+    nvs_handle_t nvs;
+    if(nvs_open(UPDATE_RESUME_NAMESPACE, NVS_READWRITE, &nvs) == ESP_OK){
+        if(nvs_erase_key(nvs, UPDATE_RESUME_KEY) == ESP_OK){
+            nvs_commit(nvs);
+        }
+        nvs_close(nvs);
+    }
+}
+
+bool UpdateClass::setPreErase(bool enable, BaseType_t core, UBaseType_t priority){
+    if(_size > 0){
+        log_w("already running");
+        return false;
+    }
+    _eraseAhead = enable;
+    _eraseCore = core;
+    _erasePriority = priority;
+    return true;
+}
+
+void UpdateClass::_eraseTask(void *arg){
+    ((UpdateClass*)arg)->_eraseLoop();
+}
+
+void UpdateClass::_eraseLoop(){
+    uint32_t debt = 0;
+    while(_eraseFrontier < _eraseEnd && !_eraseCancel){
+        uint32_t offset = _eraseFrontier;
+        size_t len = SPI_FLASH_SEC_SIZE;
+        if(_eraseBlocks && !((_partition->address + offset) % UPDATE_ERASE_BLOCK_SIZE) && _eraseEnd - offset >= UPDATE_ERASE_BLOCK_SIZE){
+            len = UPDATE_ERASE_BLOCK_SIZE;
+        }
+        uint32_t busyStart = micros();
+        if(!ESP.partitionEraseRange(_partition, offset, len)){
+            log_e("erase failed at 0x%x", offset);
+            break;
+        }
+        _eraseFrontier = offset + len;
+        xSemaphoreGive(_eraseSignal);
+        if(_throttleDuty < 100){
+            _throttle(micros() - busyStart, 0, debt);
+        }
+    }
+    //the semaphore outlives the task, so this last give is always safe
+    _eraseRunning = false;
+    xSemaphoreGive(_eraseSignal);
+    vTaskDelete(NULL);
+}
+
+bool UpdateClass::_eraseStart(){
+    if(!_eraseSignal){
+        _eraseSignal = xSemaphoreCreateBinary();
+        if(!_eraseSignal){
+            log_e("semaphore create failed");
+            return false;
+        }
+    }
+    _eraseEnd = (_size + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1);
+    //a resumed update keeps what is already written
+    _eraseFrontier = _progress;
+    _eraseCancel = false;
+    _eraseRunning = true;
+    if(xTaskCreatePinnedToCore(_eraseTask, "update_erase", UPDATE_ERASE_STACK_SIZE, this, _erasePriority, NULL, _eraseCore) != pdPASS){
+        log_e("erase task create failed");
+        _eraseRunning = false;
+        _eraseEnd = 0;
+        return false;
+    }
+    return true;
+}
+
+void UpdateClass::_eraseStop(){
+    _eraseCancel = true;
+    while(_eraseRunning){
+        xSemaphoreTake(_eraseSignal, portMAX_DELAY);
+    }
+    _eraseEnd = 0;
+}
+
+bool UpdateClass::_eraseWait(uint32_t offset){
+    while(_eraseFrontier < offset){
+        if(!_eraseRunning){
+            //failed or cancelled before reaching this sector
+            return _eraseFrontier >= offset;
+        }
+        xSemaphoreTake(_eraseSignal, portMAX_DELAY);
+    }
+    return true;
+}
+
+uint8_t UpdateClass::_pipelineSubmit(uint8_t *&data, uint32_t offset, size_t len, size_t skip){
+    update_sector_t sector = { data, offset, len, skip };
+    xQueueSend(_hashFull ? _hashFull : _pipeFull, &sector, portMAX_DELAY);
+    //blocks only while every other buffer is still queued for the hash task or the writer
+    xQueueReceive(_pipeFree, &data, portMAX_DELAY);
+    return _pipeError != UPDATE_ERROR_OK ? _pipeError : _hashError;
+}
+
+bool UpdateClass::_pipelineDrain(){
+    if(!_pipeTask){
+        return true;
+    }
+    //both tasks are idle once the writer has handed back every buffer but ours
+    uint8_t *idle[UPDATE_PIPELINE_MAX_BUFFERS];
+    for(uint8_t i = 1; i < _pipeBuffers; i++){
+        xQueueReceive(_pipeFree, &idle[i], portMAX_DELAY);
+    }
+    for(uint8_t i = 1; i < _pipeBuffers; i++){
+        xQueueSend(_pipeFree, &idle[i], 0);
+    }
+    if(_pipeError != UPDATE_ERROR_OK || _hashError != UPDATE_ERROR_OK){
+        _abort(_pipeError != UPDATE_ERROR_OK ? _pipeError : _hashError);
+        return false;
+    }
+    if(!_transform && !_sectorMap){
+        _pipelineReport();
+    }
+    return true;
+}
+
+void UpdateClass::_pipelineReport(){
+    //staged sectors are copied to PSRAM in place and never reach the writer
+    uint32_t flushed = _stage ? _progress : _pipeFlushed + _imageStart;
+    if(_progress_callback && flushed != _pipeReported){
+        _pipeReported = flushed;
+        _progress_callback(flushed, _size);
+    }
+}
+
+bool UpdateClass::_verifyHeader(uint8_t data) {
+    if(_transform || data == HEATSHRINK_MAGIC[0] || data == CHUNK_MANIFEST_MAGIC[0]) {
+        //the rebuilt image is checked when its first sector is written
+        return true;
+    } else if(_command == U_FLASH) {
+        if(data != ESP_IMAGE_HEADER_MAGIC) {
+            _abort(UPDATE_ERROR_MAGIC_BYTE);
+            return false;
+        }
+        return true;
+    } else if(_command == U_SPIFFS || _command == U_BUNDLE) {
+        return true;
+    }
+    return false;
+}
+
+bool UpdateClass::_verifyEnd() {
+    if(_command == U_FLASH && _deferActivation) {
+        //the bundle activates the app once its other sections are in
+        _reset();
+        return true;
+    } else if(_command == U_FLASH) {
+        if(!_enablePartition(_partition) || !_partitionIsBootable(_partition)) {
+            _abort(UPDATE_ERROR_READ);
+            return false;
+        }
+
+        if(esp_ota_set_boot_partition(_partition)){
+            _abort(UPDATE_ERROR_ACTIVATE);
+            return false;
+        }
+        _reset();
+        return true;
+    } else if(_command == U_SPIFFS) {
+        _reset();
+        return true;
+    } else if(_command == U_BUNDLE) {
+        //all sections checked out, switch to the new app if there is one
+        _partition = _bundleApp;
+        _command = _bundleApp ? U_FLASH : U_SPIFFS;
+        return _verifyEnd();
+    }
+    return false;
+}
+
+bool UpdateClass::setMD5(const char * expected_md5){
+    if(strlen(expected_md5) != 32)
+    {
+        return false;
+    }
+    _target_md5 = expected_md5;
+    return true;
+}
+
+String UpdateClass::md5String(void){
+    char out[ESP_ROM_MD5_DIGEST_LEN * 2 + 1];
+    for(int i = 0; i < ESP_ROM_MD5_DIGEST_LEN; i++){
+        sprintf(out + i * 2, "%02x", _md5Digest[i]);
+    }
+    return String(out);
+}
+
+// nibble value of each character, 0xff for anything that isn't hex
+static const uint8_t _hexTable[256] = {
+#define X16 0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff
+    X16, X16, X16,
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 10, 11, 12, 13, 14, 15, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    X16,
+    0xff, 10, 11, 12, 13, 14, 15, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    X16, X16, X16, X16, X16, X16, X16, X16, X16
+#undef X16
+};
+
+static bool _hexDecode(const char *hex, size_t len, uint8_t *out) {
+    for (size_t i = 0; i < len; i += 2) {
+        uint8_t hi = _hexTable[(uint8_t)hex[i]];
+        uint8_t lo = _hexTable[(uint8_t)hex[i + 1]];
+        if ((hi | lo) == 0xff) {
+            return false;
+        }
+        *out++ = (hi << 4) | lo;
+    }
+    return true;
+}
+
+bool UpdateClass::setSignature(const char* expected_signature) {
+    _target_signature_len = 0;
+    if (expected_signature == NULL) {
+        return false;
+    }
+    size_t len = strlen(expected_signature);
+    if (!(len % 2) && len / 2 <= sizeof(_target_signature) && _hexDecode(expected_signature, len, _target_signature)) {
+        _target_signature_len = len / 2;
+        return true;
+    }
+    // not hex, base64 then
+    size_t decoded = 0;
+    if (mbedtls_base64_decode(_target_signature, sizeof(_target_signature), &decoded, (const unsigned char*)expected_signature, len) != 0) {
+        log_e("bad signature");
+        return false;
+    }
+    _target_signature_len = decoded;
+    return true;
+}
+
+bool UpdateClass::setSignature(const uint8_t* signature, size_t len) {
+    _target_signature_len = 0;
+    if (signature == NULL || len > sizeof(_target_signature)) {
+        return false;
+    }
+    memcpy(_target_signature, signature, len);
+    _target_signature_len = len;
+    return true;
+}
+
+bool UpdateClass::signingKey(const char* pubkey) {
+    pubKey_toParse = pubkey;
+    if (pubKey_toParse == NULL) {
+        return signingKey(NULL, 0);
+    }
+    // the PEM parser wants the terminating 0 included
+    return _parseSigningKey((const uint8_t*)pubkey, strlen(pubkey) + 1);
+}
+
+bool UpdateClass::signingKey(const uint8_t* der, size_t len) {
+    _signingKeyEmbedded = false;
+    if (der == NULL || len == 0) {
+        mbedtls_pk_free(&_signingKey);
+        mbedtls_pk_init(&_signingKey);
+        _signingKeySet = false;
+        _signingKeyParsed = false;
+        return false;
+    }
+    return _parseSigningKey(der, len);
+}
+
+bool UpdateClass::_parseSigningKey(const uint8_t *key, size_t len) {
+    mbedtls_pk_free(&_signingKey);
+    mbedtls_pk_init(&_signingKey);
+    _signingKeyEmbedded = false;
+    _signingKeySet = true;
+    _signingKeyParsed = mbedtls_pk_parse_public_key(&_signingKey, key, len) == 0;
+    if (!_signingKeyParsed) {
+        log_e("signing key parse failed");
+        mbedtls_pk_free(&_signingKey);
+        mbedtls_pk_init(&_signingKey);
+    }
+    return _signingKeyParsed;
+}
+
+bool UpdateClass::_signingKeyReady() {
+#ifdef UPDATE_SIGNING_KEY
+    if (_signingKeyEmbedded) {
+        _parseSigningKey(update_signing_key, update_signing_key_len);
+    }
+#endif
+    return _signingKeyParsed;
+}
+
+bool UpdateClass::_signatureValid() {
+
+    // the sha256 of the downloaded fw was computed while writing it
+    uint8_t FWsha_256[32] = { 0 };
+    if (!_sha256Finish(FWsha_256)) {
+        _abort(UPDATE_ERROR_GET_SHA256);
+        return false;
+    }
+
+    // verify the signature match the hash, the key was parsed by signingKey()
+    int rc = mbedtls_pk_verify(&_signingKey, MBEDTLS_MD_SHA256, FWsha_256, 32, _target_signature, _target_signature_len);
+    if (rc != 0) {
+        _abort(UPDATE_ERROR_SIGNATURE_NOT_VALID);
+        return false;
+    }
+    return rc == 0;
+}
+
+bool UpdateClass::_bundleStart(){
+    if(!_section){
+        //kept for later bundles, like the locks it creates
+        _section = new (std::nothrow) UpdateClass();
+        if(!_section){
+            log_e("malloc failed");
+            _reset();
+            return false;
+        }
+        _section->_deferActivation = true;
+    }
+    //sections are written the way this update is set up, but are not signed on their own
+    _section->_pipeBuffers = _pipeBuffers;
+    _section->_pipeCore = _pipeCore;
+    _section->_pipePriority = _pipePriority;
+    _section->_hashTaskEnabled = _hashTaskEnabled;
+    _section->_hashCore = _hashCore;
+    _section->_hashPriority = _hashPriority;
+    _section->_eraseAhead = _eraseAhead;
+    _section->_eraseCore = _eraseCore;
+    _section->_erasePriority = _erasePriority;
+    _section->_compare = _compare;
+    //a staged section would reach the flash in its own end(), before the bundle is checked
+    _section->_staging = false;
+    _section->_bufferSize = _bufferSize;
+    _section->_throttleRate = _throttleRate;
+    _section->_throttleDuty = _throttleDuty;
+    _section->_yield_callback = _yield_callback;
+    _section->_bufferCaps = _bufferCaps;
+    _section->_signingKeySet = false;
+    _section->_signingKeyEmbedded = false;
+    _bundleApp = NULL;
+    _bundleHeaderLen = 0;
+    _bundleSections = -1;
+    _bundleLeft = 0;
+    return true;
+}
+
+bool UpdateClass::_bundleWrite(){
+    uint8_t *data = _buffer;
+    size_t len = _bufferLen;
+    esp_rom_md5_update(&_md5, data, len);
+    if(!_sha256Add(data, len)){
+        _abort(UPDATE_ERROR_GET_SHA256);
+        return false;
+    }
+    while(len){
+        if(_bundleLeft){
+            size_t part = len < _bundleLeft ? len : _bundleLeft;
+            if(_section->write(data, part) != part){
+                _abort(_section->getError());
+                return false;
+            }
+            if(mbedtls_sha256_update_ret(&_sectionSha256, data, part)){
+                _abort(UPDATE_ERROR_GET_SHA256);
+                return false;
+            }
+            data += part;
+            len -= part;
+            _bundleLeft -= part;
+            if(!_bundleLeft && !_bundleSectionEnd()){
+                return false;
+            }
+            continue;
+        }
+        if(!_bundleSections){
+            log_e("data after the last section");
+            _abort(UPDATE_ERROR_BUNDLE);
+            return false;
+        }
+        size_t need = (_bundleSections < 0 ? UPDATE_BUNDLE_HEADER_SIZE : UPDATE_BUNDLE_SECTION_SIZE) - _bundleHeaderLen;
+        size_t part = len < need ? len : need;
+        memcpy(_bundleHeader + _bundleHeaderLen, data, part);
+        _bundleHeaderLen += part;
+        data += part;
+        len -= part;
+        if(part < need){
+            break;
+        }
+        _bundleHeaderLen = 0;
+        if(_bundleSections >= 0){
+            if(!_bundleSectionStart()){
+                return false;
+            }
+        } else if(memcmp(_bundleHeader, UPDATE_BUNDLE_MAGIC, 4) || !_bundleHeader[4]){
+            log_e("bad bundle header");
+            _abort(UPDATE_ERROR_BUNDLE);
+            return false;
+        } else {
+            _bundleSections = _bundleHeader[4];
+        }
+    }
+    return true;
+}
+
+bool UpdateClass::_bundleSectionStart(){
+    const uint8_t *h = _bundleHeader;
+    uint16_t command = h[0] | (h[1] << 8);
+    uint32_t size = h[4] | (h[5] << 8) | (h[6] << 16) | ((uint32_t)h[7] << 24);
+    char label[UPDATE_BUNDLE_LABEL_SIZE + 1];
+    memcpy(label, h + 8, UPDATE_BUNDLE_LABEL_SIZE);
+    label[UPDATE_BUNDLE_LABEL_SIZE] = 0;
+    bool app = command == U_FLASH || command == U_DELTA;
+    //there is only one OTA slot to fill
+    if(!size || size == UPDATE_SIZE_UNKNOWN || (!app && command != U_SPIFFS) || (app && _bundleApp)){
+        log_e("bad section: command %u size %u", command, size);
+        _abort(UPDATE_ERROR_BUNDLE);
+        return false;
+    }
+    if(!_section->begin(size, command, -1, LOW, label[0] ? label : NULL)){
+        uint8_t err = _section->getError();
+        log_e("section '%s' not started", label);
+        _abort(err != UPDATE_ERROR_OK ? err : UPDATE_ERROR_BUNDLE);
+        return false;
+    }
+    log_d("section '%s' to %s", label, _section->_partition->label);
+    mbedtls_sha256_init(&_sectionSha256);
+    mbedtls_sha256_starts_ret(&_sectionSha256, 0);
+    _bundleLeft = size;
+    _bundleSections--;
+    return true;
+}
+
+bool UpdateClass::_bundleSectionEnd(){
+    uint8_t hash[32];
+    bool app = _section->_command == U_FLASH;
+    if(mbedtls_sha256_finish_ret(&_sectionSha256, hash) || memcmp(hash, _bundleHeader + 32, sizeof(hash))){
+        log_e("section hash mismatch on %s", _section->_partition->label);
+        _abort(UPDATE_ERROR_SECTION_HASH);
+        return false;
+    }
+    const esp_partition_t *partition = _section->_partition;
+    if(!_section->end()){
+        _abort(_section->getError());
+        return false;
+    }
+#ifdef UPDATE_STATS
+    //the flash side of the bundle happened in the section writer
+    const UpdateStats_t &sec = _section->_stats;
+    _stats.eraseMicros += sec.eraseMicros;
+    _stats.writeMicros += sec.writeMicros;
+    _stats.hashMicros += sec.hashMicros;
+    _stats.verifyMicros += sec.verifyMicros;
+    if(sec.sectors && (!_stats.sectors || sec.sectorMinMicros < _stats.sectorMinMicros)){
+        _stats.sectorMinMicros = sec.sectorMinMicros;
+    }
+    if(sec.sectorMaxMicros > _stats.sectorMaxMicros){
+        _stats.sectorMaxMicros = sec.sectorMaxMicros;
+    }
+    _stats.sectors += sec.sectors;
+    _stats.bytes += sec.bytes;
+    _stats.bytesCopied += sec.bytesCopied;
+    _statsSectorMicros += _section->_statsSectorMicros;
+#endif
+    if(app){
+        //the held back header bytes now make the app bootable in end()
+        _bundleApp = partition;
+        memcpy(_skipBuffer, _section->_skipBuffer, ENCRYPTED_BLOCK_SIZE);
+    }
+    return true;
+}
+
+bool UpdateClass::_bundleFinished(){
+    return !_bundleSections && !_bundleLeft && !_bundleHeaderLen;
+}
+
+bool UpdateClass::end(bool evenIfRemaining){
+    if(_ending){
+        log_w("ending");
+        return false;
+    }
+    return _end(evenIfRemaining);
+}
+
+bool UpdateClass::endAsync(THandlerFunction_End fn, bool evenIfRemaining, BaseType_t core, UBaseType_t priority){
+    if(hasError() || _size == 0 || _ending){
+        return false;
+    }
+    _endCallback = fn;
+    _endEvenIfRemaining = evenIfRemaining;
+    _ending = true;
+    if(xTaskCreatePinnedToCore(_endTask, "update_end", UPDATE_END_STACK_SIZE, this, priority, NULL, core) != pdPASS){
+        log_e("end task create failed");
+        _ending = false;
+        return false;
+    }
+    return true;
+}
+
+void UpdateClass::_endTask(void *arg){
+    UpdateClass *update = (UpdateClass*)arg;
+    bool ok = update->_end(update->_endEvenIfRemaining);
+    //the callback may already begin() the next update
+    THandlerFunction_End fn = update->_endCallback;
+    update->_endCallback = NULL;
+    update->_ending = false;
+    if(fn){
+        fn(ok);
+    }
+    vTaskDelete(NULL);
+}
+
+bool UpdateClass::_end(bool evenIfRemaining){
+    if(hasError() || _size == 0){
+        return false;
+    }
+
+    if(!isFinished() && !evenIfRemaining){
+        log_e("premature end: res:%u, pos:%u/%u\n", getError(), progress(), _size);
+        _abort(UPDATE_ERROR_ABORT);
+        return false;
+    }
+
+    if(evenIfRemaining) {
+        if(_bufferLen > 0 && !_writeBuffer()) {
+            return false;
+        }
+        if(hasError()) {
+            return false;
+        }
+        _size = progress();
+    }
+
+    if(_transform){
+        uint8_t err = UPDATE_ERROR_OK;
+        if(_inflate.isRunning() && !_inflate.isFinished()){
+            err = UPDATE_ERROR_DECOMPRESS;
+        } else if(_patch.isRunning() && !_patch.isFinished()){
+            err = UPDATE_ERROR_PATCH;
+        } else {
+            err = _flushOutput();
+        }
+        if(err != UPDATE_ERROR_OK){
+            _abort(err);
+            return false;
+        }
+    }
+
+    if(!_pipelineDrain()){
+        return false;
+    }
+
+    if(_manifest.isRunning() && !_manifest.isFinished()){
+        log_e("image shorter than the manifest");
+        _abort(UPDATE_ERROR_CHUNK_HASH);
+        return false;
+    }
+
+    //writeAt() hashed as the sectors came in, this only catches up
+    if(_sectorMap && !_hashWritten()){
+        return false;
+    }
+
+    if(_command == U_BUNDLE && !_bundleFinished()){
+        log_e("bundle incomplete");
+        _abort(UPDATE_ERROR_BUNDLE);
+        return false;
+    }
+
+    //everything is on the flash, a failed check below can't be resumed either
+    if(_resumeEvery && _command != U_BUNDLE){
+        _resumeClear();
+    }
+
+    esp_rom_md5_final(_md5Digest, &_md5);
+    if(_target_md5.length()) {
+        if(_target_md5 != md5String()){
+            _abort(UPDATE_ERROR_MD5);
+            return false;
+        }
+    }
+
+    // CQ, a signed manifest already vouched for every byte
+    if(_signingKeySet && !(_manifest.isSigned() && !_target_signature_len)) {
+        if(!_signingKeyReady()) {
+            _abort(UPDATE_ERROR_PARSE_PUBLIC_KEY);
+            return false;
+        }
+        UPDATE_STATS_START(verifyStart);
+        if(!_signatureValid()) {
+            _abort(UPDATE_ERROR_SIGNATURE_VERIFICATION);
+            return false;   
+        }
+        UPDATE_STATS_ADD(verifyMicros, verifyStart);
+    }
+
+    if(_stage && !_stageFlush()){
+        return false;
+    }
+
+    return _verifyEnd();
+}
+
+size_t UpdateClass::write(uint8_t *data, size_t len) {
+    if(hasError() || !isRunning() || _ending){
+        return 0;
+    }
+
+    if(len > remaining()){
+        _abort(UPDATE_ERROR_SPACE);
+        return 0;
+    }
+
+    size_t left = len;
+    while(left) {
+        uint8_t *from = data + (len - left);
+        size_t direct = _directLen(from, left);
+        if(direct) {
+            //whole sectors go to the flash from the caller's buffer, hashed in place
+            uint8_t err = _commitSector(from, _progress - _imageStart, direct);
+            if(err != UPDATE_ERROR_OK){
+                _abort(err);
+                return len - left;
+            }
+            _progress += direct;
+            left -= direct;
+            if (_progress_callback) {
+                _progress_callback(_progress, _size);
+            }
+            continue;
+        }
+        size_t toBuff = _bufferSize - _bufferLen;
+        if(toBuff > left){
+            toBuff = left;
+        }
+        memcpy(_buffer + _bufferLen, from, toBuff);
+        UPDATE_STATS_COPY(toBuff);
+        _bufferLen += toBuff;
+        //flushed right away so the rest can take the direct path
+        if((_bufferLen == _bufferSize || _bufferLen == remaining()) && !_writeBuffer()){
+            return len - left;
+        }
+        left -= toBuff;
+    }
+    return len;
+}
+
+size_t UpdateClass::_directLen(const uint8_t *data, size_t len){
+    //the header sector, transformed data and everything that needs its own
+    //copy of the sector keep going through the buffer
+    if(_bufferLen || _transform || _pipeTask || _compareBuffer || _sectorMap || _command == U_BUNDLE
+    || _progress == _imageStart || (_progress - _imageStart) % SPI_FLASH_SEC_SIZE
+    || (uintptr_t)data % sizeof(uint32_t)){
+        return 0;
+    }
+    return len & ~(SPI_FLASH_SEC_SIZE - 1);
+}
+
+uint8_t* UpdateClass::getWriteBuffer(size_t &capacity) {
+    capacity = 0;
+    if(hasError() || !isRunning() || _ending){
+        return NULL;
+    }
+    capacity = _bufferSize - _bufferLen;
+    if(capacity > remaining() - _bufferLen){
+        capacity = remaining() - _bufferLen;
+    }
+    return _buffer + _bufferLen;
+}
+
+size_t UpdateClass::commit(size_t len) {
+    if(hasError() || !isRunning() || _ending){
+        return 0;
+    }
+
+    if(_bufferLen + len > _bufferSize || len > remaining() - _bufferLen){
+        _abort(UPDATE_ERROR_SPACE);
+        return 0;
+    }
+
+    _bufferLen += len;
+    if((_bufferLen == _bufferSize || _bufferLen == remaining()) && !_writeBuffer()){
+        return 0;
+    }
+    return len;
+}
+
+size_t UpdateClass::writeStream(Stream &data) {
+    size_t written = 0;
+    size_t toRead = 0;
+    int timeout_failures = 0;
+
+    if(hasError() || !isRunning() || _ending)
+        return 0;
+
+    //a resumed or continued update doesn't start with the header
+    if(!_progress && !_bufferLen && !_verifyHeader(data.peek())) {
+        _reset();
+        return 0;
     }
 
     if(_ledPin != -1) {
@@ -420,7 +2128,7 @@ size_t UpdateClass::writeStream(Stream &data) {
         if(_ledPin != -1) {
             digitalWrite(_ledPin, _ledOn); // Switch LED on
         }
-        size_t bytesToRead = SPI_FLASH_SEC_SIZE - _bufferLen;
+        size_t bytesToRead = _bufferSize - _bufferLen;
         if(bytesToRead > remaining()) {
             bytesToRead = remaining();
         }
@@ -431,6 +2139,7 @@ size_t UpdateClass::writeStream(Stream &data) {
         */
         toRead = 0;
         timeout_failures = 0;
+        UPDATE_STATS_START(readStart);
         while(!toRead) {
             toRead = data.readBytes(_buffer + _bufferLen,  bytesToRead);
             if(toRead == 0) {
@@ -442,18 +2151,220 @@ size_t UpdateClass::writeStream(Stream &data) {
                 delay(100);
             }
         }
+        UPDATE_STATS_ADD(readMicros, readStart);
+
+        if(_ledPin != -1) {
+            digitalWrite(_ledPin, !_ledOn); // Switch LED off
+        }
+        _bufferLen += toRead;
+        if((_bufferLen == remaining() || _bufferLen == _bufferSize) && !_writeBuffer())
+            return written;
+        written += toRead;
+    }
+    return written;
+}
+
+size_t UpdateClass::writeStream(Client &data) {
+    size_t written = 0;
+    uint32_t idleSince = millis();
+
+    if(hasError() || !isRunning() || _ending)
+        return 0;
+
+    //the magic byte is checked with the first sector, peek() wouldn't
+    //wait for the first bytes to arrive
+
+    if(_ledPin != -1) {
+        pinMode(_ledPin, OUTPUT);
+    }
+
+    while(remaining()) {
+        UPDATE_STATS_START(readStart);
+        int available = data.available();
+        if(available <= 0) {
+            if(!data.connected() || millis() - idleSince >= UPDATE_STREAM_TIMEOUT_MS) {
+                _abort(UPDATE_ERROR_STREAM);
+                return written;
+            }
+            delay(1);
+            UPDATE_STATS_ADD(readMicros, readStart);
+            continue;
+        }
+
+        if(_ledPin != -1) {
+            digitalWrite(_ledPin, _ledOn); // Switch LED on
+        }
+        size_t bytesToRead = _bufferSize - _bufferLen;
+        if(bytesToRead > remaining() - _bufferLen) {
+            bytesToRead = remaining() - _bufferLen;
+        }
+        if(bytesToRead > (size_t)available) {
+            bytesToRead = available;
+        }
+        int toRead = data.read(_buffer + _bufferLen, bytesToRead);
+        UPDATE_STATS_ADD(readMicros, readStart);
+        if(_ledPin != -1) {
+            digitalWrite(_ledPin, !_ledOn); // Switch LED off
+        }
+        if(toRead <= 0) {
+            continue;
+        }
+        idleSince = millis();
+
+        _bufferLen += toRead;
+        if((_bufferLen == remaining() || _bufferLen == _bufferSize) && !_writeBuffer())
+            return written;
+        written += toRead;
+    }
+    return written;
+}
+
+size_t UpdateClass::writeFile(File &file) {
+    size_t written = 0;
+
+    if(hasError() || !isRunning() || _ending)
+        return 0;
+
+    if(_ledPin != -1) {
+        pinMode(_ledPin, OUTPUT);
+    }
 
+    while(remaining()) {
+        //sector aligned reads of the whole free buffer, the card driver
+        //transfers those without going through its own sector cache
+        size_t bytesToRead = _bufferSize - _bufferLen;
+        if(bytesToRead > remaining() - _bufferLen) {
+            bytesToRead = remaining() - _bufferLen;
+        }
+        if(_ledPin != -1) {
+            digitalWrite(_ledPin, _ledOn); // Switch LED on
+        }
+        UPDATE_STATS_START(readStart);
+        size_t toRead = file.read(_buffer + _bufferLen, bytesToRead);
+        UPDATE_STATS_ADD(readMicros, readStart);
         if(_ledPin != -1) {
             digitalWrite(_ledPin, !_ledOn); // Switch LED off
         }
+        if(!toRead || toRead > bytesToRead) {
+            log_e("file ended at %u of %u", progress() + _bufferLen, _size);
+            _abort(UPDATE_ERROR_STREAM);
+            return written;
+        }
+
         _bufferLen += toRead;
-        if((_bufferLen == remaining() || _bufferLen == SPI_FLASH_SEC_SIZE) && !_writeBuffer())
+        if((_bufferLen == remaining() || _bufferLen == _bufferSize) && !_writeBuffer())
             return written;
         written += toRead;
     }
     return written;
 }
 
+bool UpdateClass::updateFromFS(fs::FS &fs, const char *path, int command, int ledPin, uint8_t ledOn) {
+    if(_size > 0){
+        log_w("already running");
+        return false;
+    }
+    File file = fs.open(path);
+    if(!file || file.isDirectory()) {
+        log_e("can't open %s", path);
+        _error = UPDATE_ERROR_BAD_ARGUMENT;
+        return false;
+    }
+    bool ok = begin(file.size(), command, ledPin, ledOn);
+    //a resumed update carries on where its checkpoint left off
+    if(ok && resume() && !file.seek(resume())) {
+        _abort(UPDATE_ERROR_STREAM);
+        ok = false;
+    }
+    if(ok) {
+        writeFile(file);
+        ok = isFinished() && end();
+    }
+    file.close();
+    return ok;
+}
+
+int UpdateClass::poll(Stream &data, uint32_t budgetMicros, size_t maxBytes) {
+    return _poll(data, NULL, budgetMicros, maxBytes);
+}
+
+int UpdateClass::poll(Client &data, uint32_t budgetMicros, size_t maxBytes) {
+    return _poll(data, &data, budgetMicros, maxBytes);
+}
+
+int UpdateClass::_poll(Stream &data, Client *client, uint32_t budgetMicros, size_t maxBytes) {
+    if(_ending)
+        return UPDATE_POLL_DONE;
+    if(hasError() || !isRunning())
+        return UPDATE_POLL_ERROR;
+
+    uint32_t start = micros();
+    size_t done = 0;
+    while(remaining() && done < maxBytes) {
+        int available = data.available();
+        if(available <= 0) {
+            if(client && !client->connected()) {
+                _abort(UPDATE_ERROR_STREAM);
+                return UPDATE_POLL_ERROR;
+            }
+            break;
+        }
+        size_t bytesToRead = _bufferSize - _bufferLen;
+        if(bytesToRead > remaining() - _bufferLen) {
+            bytesToRead = remaining() - _bufferLen;
+        }
+        if(bytesToRead > maxBytes - done) {
+            bytesToRead = maxBytes - done;
+        }
+        if(bytesToRead > (size_t)available) {
+            bytesToRead = available;
+        }
+        //only what is available is asked for, so neither read blocks
+        UPDATE_STATS_START(readStart);
+        int toRead = client ? client->read(_buffer + _bufferLen, bytesToRead) : data.readBytes(_buffer + _bufferLen, bytesToRead);
+        UPDATE_STATS_ADD(readMicros, readStart);
+        if(toRead <= 0) {
+            break;
+        }
+        _bufferLen += toRead;
+        done += toRead;
+        if((_bufferLen == remaining() || _bufferLen == _bufferSize) && !_writeBuffer())
+            return UPDATE_POLL_ERROR;
+        if(micros() - start >= budgetMicros) {
+            break;
+        }
+    }
+    return remaining() ? UPDATE_POLL_PENDING : UPDATE_POLL_DONE;
+}
+
+void UpdateClass::_statsSector(uint32_t elapsed, size_t len){
+    if(!_stats.sectors || elapsed < _stats.sectorMinMicros){
+        _stats.sectorMinMicros = elapsed;
+    }
+    if(elapsed > _stats.sectorMaxMicros){
+        _stats.sectorMaxMicros = elapsed;
+    }
+    _stats.sectors++;
+    _stats.bytes += len;
+    _statsSectorMicros += elapsed;
+}
+
+UpdateStats_t UpdateClass::getStats(){
+    UpdateStats_t stats = _stats;
+#ifdef UPDATE_STATS
+    if(isRunning()){
+        stats.totalMicros = micros() - _statsStart;
+    }
+    if(stats.sectors){
+        stats.sectorAvgMicros = _statsSectorMicros / stats.sectors;
+    }
+    if(stats.totalMicros){
+        stats.bytesPerSecond = (uint64_t)stats.bytes * 1000000 / stats.totalMicros;
+    }
+#endif
+    return stats;
+}
+
 void UpdateClass::printError(Print &out){
     out.println(_err2str(_error));
 }
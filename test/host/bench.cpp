@@ -0,0 +1,246 @@
+/*
+  Drives write(), write(T&) and writeStream() over the mock flash with
+  different chunk sizes and stream behaviours, and reports the bytes per
+  second and how often every byte was copied on its way to the flash
+  Every run is checked against the image, a mismatch fails the run
+*/
+#include <Update.h>
+#include <chrono>
+#include <functional>
+#include <random>
+#include <vector>
+#include "esp_image_format.h"
+#include "esp_ota_ops.h"
+#include "mock_flash.h"
+
+#define BENCH_IMAGE_SIZE        (1024 * 1024)
+#define BENCH_QUICK_IMAGE_SIZE  (192 * 1024)
+#define BENCH_QUICK_SCALE       0.01f
+#define BENCH_TCP_MSS           1460
+
+typedef std::vector<uint8_t> image_t;
+
+// what write(T&) takes, e.g. a UDP packet or a ring buffer
+class ChunkSource {
+  public:
+    ChunkSource(const image_t &image, size_t chunk) : _image(image), _chunk(chunk), _pos(0){}
+    size_t available(){
+        return std::min(_chunk, _image.size() - _pos);
+    }
+    size_t read(uint8_t *buf, size_t len){
+        memcpy(buf, _image.data() + _pos, len);
+        _pos += len;
+        return len;
+    }
+
+  private:
+    const image_t &_image;
+    size_t _chunk;
+    size_t _pos;
+};
+
+// a Stream that has all of the image, bulk or Stream's own byte by byte readBytes()
+class MemoryStream : public Stream {
+  public:
+    MemoryStream(const image_t &image, bool bulk) : _image(image), _bulk(bulk), _pos(0){}
+    int available() override { return _image.size() - _pos; }
+    int read() override { return _pos < _image.size() ? _image[_pos++] : -1; }
+    int peek() override { return _pos < _image.size() ? _image[_pos] : -1; }
+    size_t write(uint8_t) override { return 0; }
+    size_t readBytes(char *buffer, size_t length) override {
+        if(!_bulk){
+            return Stream::readBytes(buffer, length);
+        }
+        length = std::min(length, _image.size() - _pos);
+        memcpy(buffer, _image.data() + _pos, length);
+        _pos += length;
+        return length;
+    }
+
+  private:
+    const image_t &_image;
+    bool _bulk;
+    size_t _pos;
+};
+
+// a TCP connection handing out up to one segment at a time, now and then
+// with nothing available while the next one is on its way
+class BurstClient : public Client {
+  public:
+    BurstClient(const image_t &image, size_t maxBurst, uint32_t gapEvery)
+    : _image(image), _maxBurst(maxBurst), _gapEvery(gapEvery), _pos(0), _burst(0), _bursts(0), _rand(1){}
+    int available() override {
+        if(!_burst && _pos < _image.size()){
+            if(_gapEvery && ++_bursts % _gapEvery == 0){
+                _bursts++;
+                return 0;
+            }
+            _burst = std::min<size_t>(1 + _rand() % _maxBurst, _image.size() - _pos);
+        }
+        return _burst;
+    }
+    int read(uint8_t *buf, size_t size) override {
+        size = std::min<size_t>(size, available());
+        memcpy(buf, _image.data() + _pos, size);
+        _pos += size;
+        _burst -= size;
+        return size;
+    }
+    int read() override {
+        uint8_t c;
+        return read(&c, 1) == 1 ? c : -1;
+    }
+    int peek() override { return _pos < _image.size() ? _image[_pos] : -1; }
+    uint8_t connected() override { return _pos < _image.size(); }
+    size_t write(uint8_t) override { return 0; }
+
+  private:
+    const image_t &_image;
+    size_t _maxBurst;
+    uint32_t _gapEvery;
+    size_t _pos;
+    size_t _burst;
+    uint32_t _bursts;
+    std::minstd_rand _rand;
+};
+
+typedef struct {
+    const char *name;
+    std::function<size_t(const image_t &)> feed;    // returns the bytes taken
+} bench_case_t;
+
+typedef struct {
+    const char *name;
+    uint8_t pipeline;
+    bool preErase;
+} bench_config_t;
+
+static size_t writeChunks(const image_t &image, size_t chunk){
+    size_t written = 0;
+    while(written < image.size()){
+        size_t len = std::min(chunk, image.size() - written);
+        size_t n = Update.write((uint8_t *)image.data() + written, len);
+        written += n;
+        if(n != len){
+            break;
+        }
+    }
+    return written;
+}
+
+static const bench_case_t cases[] = {
+    { "write() 64B", [](const image_t &image){ return writeChunks(image, 64); } },
+    { "write() 512B", [](const image_t &image){ return writeChunks(image, 512); } },
+    { "write() 1460B", [](const image_t &image){ return writeChunks(image, BENCH_TCP_MSS); } },
+    { "write() 4KB", [](const image_t &image){ return writeChunks(image, 4096); } },
+    { "write() 16KB", [](const image_t &image){ return writeChunks(image, 16384); } },
+    { "write(T&) 1460B", [](const image_t &image){ ChunkSource source(image, BENCH_TCP_MSS); return Update.write(source); } },
+    { "write(T&) 8KB", [](const image_t &image){ ChunkSource source(image, 8192); return Update.write(source); } },
+    { "writeStream(Stream&) bulk", [](const image_t &image){ MemoryStream stream(image, true); return Update.writeStream(stream); } },
+    { "writeStream(Stream&) bytewise", [](const image_t &image){ MemoryStream stream(image, false); return Update.writeStream(stream); } },
+    { "writeStream(Client&) bursts", [](const image_t &image){ BurstClient client(image, BENCH_TCP_MSS, 0); return Update.writeStream(client); } },
+    { "writeStream(Client&) gaps", [](const image_t &image){ BurstClient client(image, BENCH_TCP_MSS, 64); return Update.writeStream(client); } },
+};
+
+static const bench_config_t configs[] = {
+    { "direct", 0, false },
+    { "pipeline", 2, false },
+    { "pipeline+erase", 2, true },
+};
+
+static image_t makeImage(size_t size){
+    image_t image(size);
+    std::minstd_rand rand(size);
+    for(uint8_t &b : image){
+        b = rand();
+    }
+    image[0] = ESP_IMAGE_HEADER_MAGIC;
+    return image;
+}
+
+static String md5Of(const image_t &image){
+    MD5Builder md5;
+    md5.begin();
+    for(size_t offset = 0; offset < image.size(); offset += 0x8000){
+        md5.add(image.data() + offset, std::min<size_t>(0x8000, image.size() - offset));
+    }
+    md5.calculate();
+    return md5.toString();
+}
+
+static bool runCase(const bench_case_t &c, const bench_config_t &config, const image_t &image, const String &md5){
+    mock_flash_reset();
+    Update.setPipeline(config.pipeline);
+    Update.setPreErase(config.preErase);
+    auto start = std::chrono::steady_clock::now();
+    bool ok = Update.begin(image.size()) && Update.setMD5(md5.c_str());
+    size_t taken = ok ? c.feed(image) : 0;
+    UpdateStats_t stats = Update.getStats();
+    ok = ok && taken == image.size() && Update.end();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    const esp_partition_t *partition = esp_ota_get_next_update_partition(NULL);
+    ok = ok && !memcmp(mock_flash_data(partition), image.data(), image.size());
+    const mock_flash_counters_t *flash = mock_flash_counters();
+    printf("%-30s %-15s %10.0f %9.2f %7u %8u %8.1f%%  %s\n", c.name, config.name,
+        image.size() / seconds, (double)stats.bytesCopied / image.size(),
+        flash->erases, flash->programs, flash->busyMicros / 1e4 / seconds,
+        ok ? "ok" : Update.errorString());
+    if(!ok){
+        Update.abort();
+    }
+    return ok;
+}
+
+static void usage(){
+    printf("usage: update_bench [--quick] [--size bytes] [--scale factor] [--filter text]\n"
+           "  --quick   small image and flash 100x faster than typical, for ctest\n"
+           "  --size    image size, %u by default\n"
+           "  --scale   flash latency relative to the typical chip, 1 by default\n"
+           "  --filter  only cases whose name contains text\n", BENCH_IMAGE_SIZE);
+}
+
+int main(int argc, char **argv){
+    size_t size = BENCH_IMAGE_SIZE;
+    float scale = 1.0f;
+    const char *filter = NULL;
+    for(int i = 1; i < argc; i++){
+        if(!strcmp(argv[i], "--quick")){
+            size = BENCH_QUICK_IMAGE_SIZE;
+            scale = BENCH_QUICK_SCALE;
+        } else if(!strcmp(argv[i], "--size") && i + 1 < argc){
+            size = strtoul(argv[++i], NULL, 0);
+        } else if(!strcmp(argv[i], "--scale") && i + 1 < argc){
+            scale = strtof(argv[++i], NULL);
+        } else if(!strcmp(argv[i], "--filter") && i + 1 < argc){
+            filter = argv[++i];
+        } else {
+            usage();
+            return 2;
+        }
+    }
+    if(size < 2 * SPI_FLASH_SEC_SIZE || size > esp_ota_get_next_update_partition(NULL)->size){
+        printf("size must be from %u to the size of the OTA partition\n", 2 * SPI_FLASH_SEC_SIZE);
+        return 2;
+    }
+
+    const mock_flash_timing_t typical = MOCK_FLASH_TIMING_TYPICAL;
+    mock_flash_set_timing(&typical, scale);
+    image_t image = makeImage(size);
+    String md5 = md5Of(image);
+
+    printf("%u byte image, flash latency x%g\n", (unsigned)size, scale);
+    printf("%-30s %-15s %10s %9s %7s %8s %9s\n", "case", "config", "bytes/s", "copies/B", "erases", "programs", "flash busy");
+    int failed = 0;
+    for(const bench_case_t &c : cases){
+        if(filter && !strstr(c.name, filter)){
+            continue;
+        }
+        for(const bench_config_t &config : configs){
+            failed += !runCase(c, config, image, md5);
+        }
+    }
+    if(failed){
+        printf("%d runs failed\n", failed);
+    }
+    return failed ? 1 : 0;
+}
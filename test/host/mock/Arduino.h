@@ -0,0 +1,82 @@
+#pragma once
+// Just enough of the Arduino core to build the updater on the host
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_err.h"
+#include "esp_partition.h"
+#include "Esp.h"
+
+#define LOW     0
+#define HIGH    1
+#define OUTPUT  0x03
+
+#define log_e(format, ...) fprintf(stderr, "[E] " format "\n", ##__VA_ARGS__)
+#define log_w(format, ...) fprintf(stderr, "[W] " format "\n", ##__VA_ARGS__)
+#define log_i(format, ...) do {} while(0)
+#define log_d(format, ...) do {} while(0)
+#define log_v(format, ...) do {} while(0)
+
+unsigned long millis();
+unsigned long micros();
+void delay(uint32_t ms);
+void yield();
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+
+class String {
+  public:
+    String(){}
+    String(const char *cstr) : _s(cstr ? cstr : ""){}
+    unsigned int length() const { return _s.length(); }
+    const char *c_str() const { return _s.c_str(); }
+    bool operator==(const String &rhs) const { return _s == rhs._s; }
+    bool operator!=(const String &rhs) const { return _s != rhs._s; }
+
+  private:
+    std::string _s;
+};
+
+extern const String emptyString;
+
+class Print {
+  public:
+    virtual ~Print(){}
+    virtual size_t write(uint8_t) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size){
+        size_t n = 0;
+        while(n < size && write(buffer[n])){
+            n++;
+        }
+        return n;
+    }
+    size_t print(const char *str){ return write((const uint8_t *)str, strlen(str)); }
+    size_t println(const char *str){ return print(str) + print("\r\n"); }
+};
+
+class Stream : public Print {
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    void setTimeout(unsigned long timeout){ _timeout = timeout; }
+    // byte by byte with the stream timeout, like the core
+    virtual size_t readBytes(char *buffer, size_t length);
+    size_t readBytes(uint8_t *buffer, size_t length){ return readBytes((char *)buffer, length); }
+
+  protected:
+    int timedRead();
+    unsigned long _timeout = 1000;
+};
+
+class Client : public Stream {
+  public:
+    virtual int read(uint8_t *buf, size_t size) = 0;
+    virtual uint8_t connected() = 0;
+    using Stream::read;
+};
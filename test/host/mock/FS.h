@@ -0,0 +1,34 @@
+#pragma once
+#include <Arduino.h>
+#include <map>
+#include <string>
+#include <vector>
+
+// files live in memory, keyed by path
+namespace fs {
+
+class File {
+  public:
+    File(const std::vector<uint8_t> *data = NULL) : _data(data), _pos(0){}
+    size_t read(uint8_t *buf, size_t size);
+    bool seek(uint32_t pos);
+    size_t size() const { return _data ? _data->size() : 0; }
+    bool isDirectory(){ return false; }
+    void close(){ _data = NULL; }
+    operator bool() const { return _data != NULL; }
+
+  private:
+    const std::vector<uint8_t> *_data;
+    size_t _pos;
+};
+
+class FS {
+  public:
+    File open(const char *path, const char *mode = "r", const bool create = false);
+    std::map<std::string, std::vector<uint8_t>> files;
+};
+
+}
+
+using fs::FS;
+using fs::File;
@@ -0,0 +1,18 @@
+#pragma once
+#include <Arduino.h>
+#include "esp_rom_md5.h"
+
+class MD5Builder {
+  public:
+    void begin(void);
+    void add(const uint8_t *data, uint16_t len);
+    void add(const char *data){ add((const uint8_t *)data, strlen(data)); }
+    void calculate(void);
+    void getBytes(uint8_t *output);
+    void getChars(char *output);
+    String toString(void);
+
+  private:
+    md5_context_t _ctx;
+    uint8_t _buf[ESP_ROM_MD5_DIGEST_LEN];
+};
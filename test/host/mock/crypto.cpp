@@ -0,0 +1,281 @@
+// SHA-256, MD5 and base64 in plain C++, no public key crypto
+#include <MD5Builder.h>
+#include "esp_rom_md5.h"
+#include "mbedtls/base64.h"
+#include "mbedtls/pk.h"
+#include "mbedtls/sha256.h"
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static void sha256_block(mbedtls_sha256_context *ctx, const unsigned char *data){
+    uint32_t w[64];
+    for(int i = 0; i < 16; i++){
+        w[i] = (uint32_t)data[i * 4] << 24 | (uint32_t)data[i * 4 + 1] << 16 | (uint32_t)data[i * 4 + 2] << 8 | data[i * 4 + 3];
+    }
+    for(int i = 16; i < 64; i++){
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t v[8];
+    memcpy(v, ctx->state, sizeof(v));
+    for(int i = 0; i < 64; i++){
+        uint32_t s1 = ROTR(v[4], 6) ^ ROTR(v[4], 11) ^ ROTR(v[4], 25);
+        uint32_t ch = (v[4] & v[5]) ^ (~v[4] & v[6]);
+        uint32_t t1 = v[7] + s1 + ch + sha256_k[i] + w[i];
+        uint32_t s0 = ROTR(v[0], 2) ^ ROTR(v[0], 13) ^ ROTR(v[0], 22);
+        uint32_t maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+        memmove(v + 1, v, 7 * sizeof(uint32_t));
+        v[4] += t1;
+        v[0] = t1 + s0 + maj;
+    }
+    for(int i = 0; i < 8; i++){
+        ctx->state[i] += v[i];
+    }
+}
+
+void mbedtls_sha256_init(mbedtls_sha256_context *ctx){
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+void mbedtls_sha256_free(mbedtls_sha256_context *ctx){
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+void mbedtls_sha256_clone(mbedtls_sha256_context *dst, const mbedtls_sha256_context *src){
+    *dst = *src;
+}
+
+int mbedtls_sha256_starts_ret(mbedtls_sha256_context *ctx, int is224){
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    if(is224){
+        return -1;
+    }
+    memset(ctx, 0, sizeof(*ctx));
+    memcpy(ctx->state, iv, sizeof(iv));
+    return 0;
+}
+
+int mbedtls_sha256_update_ret(mbedtls_sha256_context *ctx, const unsigned char *input, size_t ilen){
+    size_t fill = ctx->total[0] % 64;
+    uint64_t total = ((uint64_t)ctx->total[1] << 32 | ctx->total[0]) + ilen;
+    ctx->total[0] = (uint32_t)total;
+    ctx->total[1] = (uint32_t)(total >> 32);
+    if(fill && fill + ilen >= 64){
+        memcpy(ctx->buffer + fill, input, 64 - fill);
+        sha256_block(ctx, ctx->buffer);
+        input += 64 - fill;
+        ilen -= 64 - fill;
+        fill = 0;
+    }
+    for(; ilen >= 64; input += 64, ilen -= 64){
+        sha256_block(ctx, input);
+    }
+    memcpy(ctx->buffer + fill, input, ilen);
+    return 0;
+}
+
+int mbedtls_sha256_finish_ret(mbedtls_sha256_context *ctx, unsigned char output[32]){
+    uint64_t bits = ((uint64_t)ctx->total[1] << 32 | ctx->total[0]) * 8;
+    unsigned char pad[72] = { 0x80 };
+    size_t padLen = (ctx->total[0] % 64 < 56 ? 56 : 120) - ctx->total[0] % 64;
+    for(int i = 0; i < 8; i++){
+        pad[padLen + i] = bits >> (56 - i * 8);
+    }
+    mbedtls_sha256_update_ret(ctx, pad, padLen + 8);
+    for(int i = 0; i < 8; i++){
+        output[i * 4] = ctx->state[i] >> 24;
+        output[i * 4 + 1] = ctx->state[i] >> 16;
+        output[i * 4 + 2] = ctx->state[i] >> 8;
+        output[i * 4 + 3] = ctx->state[i];
+    }
+    return 0;
+}
+
+int mbedtls_sha256_ret(const unsigned char *input, size_t ilen, unsigned char output[32], int is224){
+    mbedtls_sha256_context ctx;
+    int ret = mbedtls_sha256_starts_ret(&ctx, is224);
+    if(!ret){
+        ret = mbedtls_sha256_update_ret(&ctx, input, ilen) || mbedtls_sha256_finish_ret(&ctx, output);
+    }
+    mbedtls_sha256_free(&ctx);
+    return ret;
+}
+
+static const uint32_t md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const uint8_t md5_r[16] = { 7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21 };
+
+static void md5_block(md5_context_t *ctx, const uint8_t *data){
+    uint32_t m[16];
+    for(int i = 0; i < 16; i++){
+        m[i] = data[i * 4] | (uint32_t)data[i * 4 + 1] << 8 | (uint32_t)data[i * 4 + 2] << 16 | (uint32_t)data[i * 4 + 3] << 24;
+    }
+    uint32_t a = ctx->buf[0], b = ctx->buf[1], c = ctx->buf[2], d = ctx->buf[3];
+    for(int i = 0; i < 64; i++){
+        uint32_t f;
+        int g;
+        if(i < 16){
+            f = (b & c) | (~b & d);
+            g = i;
+        } else if(i < 32){
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) % 16;
+        } else if(i < 48){
+            f = b ^ c ^ d;
+            g = (3 * i + 5) % 16;
+        } else {
+            f = c ^ (b | ~d);
+            g = (7 * i) % 16;
+        }
+        uint32_t rotated = b + ROTL(a + f + md5_k[i] + m[g], md5_r[i / 16 * 4 + i % 4]);
+        a = d;
+        d = c;
+        c = b;
+        b = rotated;
+    }
+    ctx->buf[0] += a;
+    ctx->buf[1] += b;
+    ctx->buf[2] += c;
+    ctx->buf[3] += d;
+}
+
+void esp_rom_md5_init(md5_context_t *context){
+    static const uint32_t iv[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+    memset(context, 0, sizeof(*context));
+    memcpy(context->buf, iv, sizeof(iv));
+}
+
+void esp_rom_md5_update(md5_context_t *context, const void *buf, uint32_t len){
+    const uint8_t *data = (const uint8_t *)buf;
+    size_t fill = context->bits[0] / 8 % 64;
+    uint64_t bits = ((uint64_t)context->bits[1] << 32 | context->bits[0]) + (uint64_t)len * 8;
+    context->bits[0] = (uint32_t)bits;
+    context->bits[1] = (uint32_t)(bits >> 32);
+    if(fill && fill + len >= 64){
+        memcpy(context->in + fill, data, 64 - fill);
+        md5_block(context, context->in);
+        data += 64 - fill;
+        len -= 64 - fill;
+        fill = 0;
+    }
+    for(; len >= 64; data += 64, len -= 64){
+        md5_block(context, data);
+    }
+    memcpy(context->in + fill, data, len);
+}
+
+void esp_rom_md5_final(uint8_t *digest, md5_context_t *context){
+    uint32_t low = context->bits[0], high = context->bits[1];
+    uint8_t pad[72] = { 0x80 };
+    size_t padLen = (low / 8 % 64 < 56 ? 56 : 120) - low / 8 % 64;
+    for(int i = 0; i < 4; i++){
+        pad[padLen + i] = low >> (i * 8);
+        pad[padLen + 4 + i] = high >> (i * 8);
+    }
+    esp_rom_md5_update(context, pad, padLen + 8);
+    for(int i = 0; i < ESP_ROM_MD5_DIGEST_LEN; i++){
+        digest[i] = context->buf[i / 4] >> (i % 4 * 8);
+    }
+}
+
+void MD5Builder::begin(void){
+    memset(_buf, 0, sizeof(_buf));
+    esp_rom_md5_init(&_ctx);
+}
+
+void MD5Builder::add(const uint8_t *data, uint16_t len){
+    esp_rom_md5_update(&_ctx, data, len);
+}
+
+void MD5Builder::calculate(void){
+    esp_rom_md5_final(_buf, &_ctx);
+}
+
+void MD5Builder::getBytes(uint8_t *output){
+    memcpy(output, _buf, sizeof(_buf));
+}
+
+void MD5Builder::getChars(char *output){
+    for(int i = 0; i < ESP_ROM_MD5_DIGEST_LEN; i++){
+        sprintf(output + i * 2, "%02x", _buf[i]);
+    }
+}
+
+String MD5Builder::toString(void){
+    char out[ESP_ROM_MD5_DIGEST_LEN * 2 + 1];
+    getChars(out);
+    return String(out);
+}
+
+void mbedtls_pk_init(mbedtls_pk_context *ctx){
+    ctx->pk_info = NULL;
+    ctx->pk_ctx = NULL;
+}
+
+void mbedtls_pk_free(mbedtls_pk_context *ctx){
+    mbedtls_pk_init(ctx);
+}
+
+int mbedtls_pk_parse_public_key(mbedtls_pk_context *ctx, const unsigned char *key, size_t keylen){
+    return MBEDTLS_ERR_PK_FEATURE_UNAVAILABLE;
+}
+
+int mbedtls_pk_verify(mbedtls_pk_context *ctx, mbedtls_md_type_t md_alg, const unsigned char *hash, size_t hash_len, const unsigned char *sig, size_t sig_len){
+    return MBEDTLS_ERR_PK_FEATURE_UNAVAILABLE;
+}
+
+int mbedtls_base64_decode(unsigned char *dst, size_t dlen, size_t *olen, const unsigned char *src, size_t slen){
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    uint32_t acc = 0;
+    int bits = 0;
+    size_t n = 0;
+    size_t pad = 0;
+    for(size_t i = 0; i < slen; i++){
+        if(src[i] == '='){
+            pad++;
+            continue;
+        }
+        const char *p = src[i] ? strchr(alphabet, src[i]) : NULL;
+        if(!p || pad){
+            return MBEDTLS_ERR_BASE64_INVALID_CHARACTER;
+        }
+        acc = acc << 6 | (p - alphabet);
+        bits += 6;
+        if(bits >= 8){
+            bits -= 8;
+            if(n >= dlen){
+                return MBEDTLS_ERR_BASE64_BUFFER_TOO_SMALL;
+            }
+            dst[n++] = acc >> bits;
+        }
+    }
+    if(slen % 4 || pad > 2){
+        return MBEDTLS_ERR_BASE64_INVALID_CHARACTER;
+    }
+    *olen = n;
+    return 0;
+}
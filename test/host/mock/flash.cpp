@@ -0,0 +1,176 @@
+#include <Arduino.h>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include "esp_ota_ops.h"
+#include "mbedtls/sha256.h"
+#include "mock_flash.h"
+
+#define MOCK_FLASH_SIZE         0x400000
+#define MOCK_FLASH_PAGE_SIZE    256
+#define MOCK_FLASH_BLOCK_SIZE   0x10000
+
+static uint8_t flash[MOCK_FLASH_SIZE];
+static std::mutex flash_bus;
+static mock_flash_timing_t timing = { 0, 0, 0, 0 };
+static mock_flash_counters_t counters;
+
+// app0 runs, app1 takes the updates, as with the default partition table
+static esp_partition_t partitions[] = {
+    { NULL, ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, 0x10000, 0x180000, "app0", false },
+    { NULL, ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_1, 0x190000, 0x180000, "app1", false },
+    { NULL, ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, 0x310000, 0xE0000, "spiffs", false },
+};
+static const esp_partition_t *boot_partition = &partitions[0];
+
+void mock_flash_set_timing(const mock_flash_timing_t *t, float scale){
+    timing.sectorEraseMicros = t->sectorEraseMicros * scale;
+    timing.blockEraseMicros = t->blockEraseMicros * scale;
+    timing.pageProgramMicros = t->pageProgramMicros * scale;
+    timing.readKbMicros = t->readKbMicros * scale;
+}
+
+void mock_flash_reset(void){
+    std::lock_guard<std::mutex> lock(flash_bus);
+    memset(flash, 0xFF, sizeof(flash));
+    memset(&counters, 0, sizeof(counters));
+    boot_partition = &partitions[0];
+}
+
+const mock_flash_counters_t *mock_flash_counters(void){
+    return &counters;
+}
+
+const uint8_t *mock_flash_data(const esp_partition_t *partition){
+    return flash + partition->address;
+}
+
+// called with the bus held, which stays busy for the modelled time
+static void flash_busy(uint32_t us){
+    counters.busyMicros += us;
+    if(us){
+        std::this_thread::sleep_for(std::chrono::microseconds(us));
+    }
+}
+
+static bool in_partition(const esp_partition_t *partition, size_t offset, size_t size){
+    return partition && offset <= partition->size && size <= partition->size - offset;
+}
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label){
+    for(const esp_partition_t &p : partitions){
+        if(p.type == type && (subtype == ESP_PARTITION_SUBTYPE_ANY || p.subtype == subtype)
+        && (!label || !strcmp(label, p.label))){
+            return &p;
+        }
+    }
+    return NULL;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size){
+    if(!in_partition(partition, offset, size) || offset % SPI_FLASH_SEC_SIZE || size % SPI_FLASH_SEC_SIZE){
+        return ESP_ERR_INVALID_ARG;
+    }
+    std::lock_guard<std::mutex> lock(flash_bus);
+    uint32_t address = partition->address + offset;
+    memset(flash + address, 0xFF, size);
+    //the chip erases a whole aligned block at once, anything else sector by sector
+    uint32_t us = 0;
+    while(size){
+        size_t len = SPI_FLASH_SEC_SIZE;
+        if(!(address % MOCK_FLASH_BLOCK_SIZE) && size >= MOCK_FLASH_BLOCK_SIZE){
+            len = MOCK_FLASH_BLOCK_SIZE;
+            us += timing.blockEraseMicros;
+        } else {
+            us += timing.sectorEraseMicros;
+        }
+        counters.erases++;
+        counters.erasedBytes += len;
+        address += len;
+        size -= len;
+    }
+    flash_busy(us);
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t *partition, size_t offset, const void *src, size_t size){
+    if(!in_partition(partition, offset, size)){
+        return ESP_ERR_INVALID_ARG;
+    }
+    std::lock_guard<std::mutex> lock(flash_bus);
+    uint32_t address = partition->address + offset;
+    const uint8_t *data = (const uint8_t *)src;
+    for(size_t i = 0; i < size; i++){
+        flash[address + i] &= data[i];
+    }
+    uint32_t pages = (address + size + MOCK_FLASH_PAGE_SIZE - 1) / MOCK_FLASH_PAGE_SIZE - address / MOCK_FLASH_PAGE_SIZE;
+    counters.programs++;
+    counters.programmedBytes += size;
+    flash_busy(pages * timing.pageProgramMicros);
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t offset, void *dst, size_t size){
+    if(!in_partition(partition, offset, size)){
+        return ESP_ERR_INVALID_ARG;
+    }
+    std::lock_guard<std::mutex> lock(flash_bus);
+    memcpy(dst, flash + partition->address + offset, size);
+    counters.reads++;
+    counters.readBytes += size;
+    flash_busy((size + 1023) / 1024 * timing.readKbMicros);
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_get_sha256(const esp_partition_t *partition, uint8_t *sha_256){
+    std::lock_guard<std::mutex> lock(flash_bus);
+    return mbedtls_sha256_ret(flash + partition->address, partition->size, sha_256, 0) ? ESP_FAIL : ESP_OK;
+}
+
+EspClass ESP;
+
+bool EspClass::partitionEraseRange(const esp_partition_t *partition, uint32_t offset, size_t size){
+    return esp_partition_erase_range(partition, offset, size) == ESP_OK;
+}
+
+bool EspClass::partitionWrite(const esp_partition_t *partition, uint32_t offset, uint32_t *data, size_t size){
+    return esp_partition_write(partition, offset, data, size) == ESP_OK;
+}
+
+bool EspClass::partitionRead(const esp_partition_t *partition, uint32_t offset, uint32_t *data, size_t size){
+    return esp_partition_read(partition, offset, data, size) == ESP_OK;
+}
+
+void EspClass::restart(){
+    fprintf(stderr, "restart\n");
+    exit(0);
+}
+
+const esp_partition_t *esp_ota_get_running_partition(void){
+    return &partitions[0];
+}
+
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *start_from){
+    return &partitions[1];
+}
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *partition){
+    if(!partition || partition->type != ESP_PARTITION_TYPE_APP){
+        return ESP_ERR_INVALID_ARG;
+    }
+    boot_partition = partition;
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_get_state_partition(const esp_partition_t *partition, esp_ota_img_states_t *ota_state){
+    *ota_state = ESP_OTA_IMG_VALID;
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_mark_app_valid_cancel_rollback(void){
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_mark_app_invalid_rollback_and_reboot(void){
+    return ESP_FAIL;
+}
@@ -0,0 +1,10 @@
+#pragma once
+#include "FreeRTOS.h"
+
+// tasks are host threads, priorities and cores are ignored
+typedef void *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t code, const char *name, uint32_t stackDepth, void *param, UBaseType_t priority, TaskHandle_t *created, BaseType_t core);
+void vTaskDelete(TaskHandle_t task);
+void vTaskDelay(TickType_t ticks);
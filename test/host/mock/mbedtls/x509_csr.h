@@ -0,0 +1,2 @@
+#pragma once
+// included by Updater.cpp for the PEM helpers, nothing of it is used
@@ -0,0 +1,34 @@
+#pragma once
+#include <stdint.h>
+#include "esp_partition.h"
+
+/*
+  Flash model behind esp_partition_* and ESP.partition*()
+  4MB of NOR flash: erasing sets bytes to 0xFF, programming can only clear bits
+  Every operation holds the one flash bus for its modelled time, so a writer
+  and the background erase wait for each other like on the chip
+*/
+typedef struct {
+    uint32_t sectorEraseMicros;     // per 4KB sector
+    uint32_t blockEraseMicros;      // per aligned 64KB block erased in one call
+    uint32_t pageProgramMicros;     // per 256 byte page started
+    uint32_t readKbMicros;          // per KB read
+} mock_flash_timing_t;
+
+typedef struct {
+    uint32_t erases;
+    uint32_t erasedBytes;
+    uint32_t programs;
+    uint32_t programmedBytes;
+    uint32_t reads;
+    uint32_t readBytes;
+    uint64_t busyMicros;            // modelled time the flash was busy
+} mock_flash_counters_t;
+
+// typical datasheet figures of the SPI NOR flash on ESP32 modules
+#define MOCK_FLASH_TIMING_TYPICAL { 45000, 150000, 700, 25 }
+
+void mock_flash_set_timing(const mock_flash_timing_t *timing, float scale = 1.0f);
+void mock_flash_reset(void);    // erased flash, counters cleared
+const mock_flash_counters_t *mock_flash_counters(void);
+const uint8_t *mock_flash_data(const esp_partition_t *partition);
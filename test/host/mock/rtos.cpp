@@ -0,0 +1,117 @@
+// FreeRTOS tasks, queues and semaphores on host threads
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+struct mock_queue_t {
+    std::mutex lock;
+    std::condition_variable changed;
+    std::deque<std::vector<uint8_t>> items;
+    size_t length;
+    size_t itemSize;
+};
+
+// thrown by vTaskDelete(NULL) to leave the task function
+struct mock_task_exit_t {};
+
+// nothing is done through the handles, they only tell the tasks apart
+static uintptr_t task_count;
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t code, const char *name, uint32_t stackDepth, void *param, UBaseType_t priority, TaskHandle_t *created, BaseType_t core){
+    std::thread([code, param](){
+        try {
+            code(param);
+        } catch(mock_task_exit_t &){
+        }
+    }).detach();
+    if(created){
+        *created = (TaskHandle_t)++task_count;
+    }
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task){
+    if(!task){
+        throw mock_task_exit_t();
+    }
+}
+
+void vTaskDelay(TickType_t ticks){
+    std::this_thread::sleep_for(std::chrono::milliseconds(ticks * portTICK_PERIOD_MS));
+}
+
+static bool queue_wait(mock_queue_t *q, std::unique_lock<std::mutex> &lock, TickType_t ticks, bool forSpace){
+    auto ready = [q, forSpace](){ return forSpace ? q->items.size() < q->length : !q->items.empty(); };
+    if(ticks == portMAX_DELAY){
+        q->changed.wait(lock, ready);
+        return true;
+    }
+    return q->changed.wait_for(lock, std::chrono::milliseconds(ticks * portTICK_PERIOD_MS), ready);
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize){
+    mock_queue_t *q = new mock_queue_t;
+    q->length = length;
+    q->itemSize = itemSize;
+    return q;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks){
+    mock_queue_t *q = (mock_queue_t *)queue;
+    std::unique_lock<std::mutex> lock(q->lock);
+    if(!queue_wait(q, lock, ticks, true)){
+        return pdFALSE;
+    }
+    const uint8_t *bytes = (const uint8_t *)item;
+    q->items.emplace_back(bytes, bytes + (item ? q->itemSize : 0));
+    q->changed.notify_all();
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks){
+    mock_queue_t *q = (mock_queue_t *)queue;
+    std::unique_lock<std::mutex> lock(q->lock);
+    if(!queue_wait(q, lock, ticks, false)){
+        return pdFALSE;
+    }
+    if(item && q->itemSize){
+        memcpy(item, q->items.front().data(), q->itemSize);
+    }
+    q->items.pop_front();
+    q->changed.notify_all();
+    return pdTRUE;
+}
+
+void vQueueDelete(QueueHandle_t queue){
+    delete (mock_queue_t *)queue;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void){
+    return xQueueCreate(1, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void){
+    SemaphoreHandle_t semaphore = xQueueCreate(1, 0);
+    xSemaphoreGive(semaphore);
+    return semaphore;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore){
+    return xQueueSend(semaphore, NULL, 0);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks){
+    return xQueueReceive(semaphore, NULL, ticks);
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore){
+    vQueueDelete(semaphore);
+}
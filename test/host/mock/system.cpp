@@ -0,0 +1,179 @@
+// Arduino core, heap, NVS, timers and files on the host
+#include <Arduino.h>
+#include <FS.h>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "nvs.h"
+
+static const auto boot = std::chrono::steady_clock::now();
+
+unsigned long millis(){
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - boot).count();
+}
+
+unsigned long micros(){
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - boot).count();
+}
+
+void delay(uint32_t ms){
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void yield(){
+    std::this_thread::yield();
+}
+
+void pinMode(uint8_t pin, uint8_t mode){}
+
+void digitalWrite(uint8_t pin, uint8_t val){}
+
+const String emptyString;
+
+int Stream::timedRead(){
+    unsigned long start = millis();
+    do {
+        int c = read();
+        if(c >= 0){
+            return c;
+        }
+        yield();
+    } while(millis() - start < _timeout);
+    return -1;
+}
+
+size_t Stream::readBytes(char *buffer, size_t length){
+    size_t count = 0;
+    while(count < length){
+        int c = timedRead();
+        if(c < 0){
+            break;
+        }
+        *buffer++ = (char)c;
+        count++;
+    }
+    return count;
+}
+
+// PSRAM and internal RAM are the same heap here
+void *heap_caps_malloc(size_t size, uint32_t caps){
+    return malloc(size);
+}
+
+void *heap_caps_realloc(void *ptr, size_t size, uint32_t caps){
+    return realloc(ptr, size);
+}
+
+void heap_caps_free(void *ptr){
+    free(ptr);
+}
+
+// one namespace is all the updater uses
+static std::map<std::string, std::vector<uint8_t>> nvs_blobs;
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle){
+    *out_handle = 1;
+    return ESP_OK;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length){
+    const uint8_t *bytes = (const uint8_t *)value;
+    nvs_blobs[key].assign(bytes, bytes + length);
+    return ESP_OK;
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value, size_t *length){
+    auto blob = nvs_blobs.find(key);
+    if(blob == nvs_blobs.end()){
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    if(out_value){
+        if(*length < blob->second.size()){
+            return ESP_ERR_INVALID_SIZE;
+        }
+        memcpy(out_value, blob->second.data(), blob->second.size());
+    }
+    *length = blob->second.size();
+    return ESP_OK;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key){
+    return nvs_blobs.erase(key) ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle){
+    return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t handle){}
+
+// every start sleeps on a thread of its own, stop and delete outdate it
+struct esp_timer {
+    esp_timer_create_args_t args;
+    std::atomic<uint32_t> generation;
+};
+
+int64_t esp_timer_get_time(void){
+    return micros();
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *create_args, esp_timer_handle_t *out_handle){
+    esp_timer_handle_t timer = new esp_timer;
+    timer->args = *create_args;
+    timer->generation = 0;
+    *out_handle = timer;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us){
+    uint32_t generation = ++timer->generation;
+    std::thread([timer, generation, timeout_us](){
+        std::this_thread::sleep_for(std::chrono::microseconds(timeout_us));
+        if(timer->generation == generation){
+            timer->args.callback(timer->args.arg);
+        }
+    }).detach();
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer){
+    timer->generation++;
+    return ESP_OK;
+}
+
+// a sleeping thread may still look at the timer, so it is never freed
+esp_err_t esp_timer_delete(esp_timer_handle_t timer){
+    timer->generation++;
+    return ESP_OK;
+}
+
+size_t fs::File::read(uint8_t *buf, size_t size){
+    if(!_data){
+        return 0;
+    }
+    if(size > _data->size() - _pos){
+        size = _data->size() - _pos;
+    }
+    memcpy(buf, _data->data() + _pos, size);
+    _pos += size;
+    return size;
+}
+
+bool fs::File::seek(uint32_t pos){
+    if(!_data || pos > _data->size()){
+        return false;
+    }
+    _pos = pos;
+    return true;
+}
+
+fs::File fs::FS::open(const char *path, const char *mode, const bool create){
+    auto file = files.find(path);
+    return File(file == files.end() ? NULL : &file->second);
+}